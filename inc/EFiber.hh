@@ -21,6 +21,7 @@ class EContext;
 class EIoWaiter;
 class EFiberBlocker;
 class EFiberScheduler;
+struct PriorityRuns;
 template<typename E>
 class EFiberLocal;
 
@@ -36,6 +37,23 @@ public:
 		TERMINATED
 	};
 
+	/**
+	 * Run queue classes of a scheduler with a priority policy, see
+	 * EFiberScheduler::setPriorityPolicy().
+	 */
+	enum Priority {
+		PRIORITY_URGENT = 0, // health checks, rpc handlers
+		PRIORITY_NORMAL = 1,
+		PRIORITY_BACKGROUND = 2 // bulk work
+	};
+	static const int PRIORITY_CLASSES = 3;
+
+	/**
+	 * Fiber groups of a scheduler with PRIORITY_FAIR_SHARE, e.g. one per
+	 * tenant, see EFiberScheduler::setGroupWeight().
+	 */
+	static const int MAX_GROUPS = 16;
+
 	static const int DEFAULT_STACK_SIZE = 1024*1024; //1M
 #ifdef __linux__
 	static const int MIN_STACK_SIZE = 8192;
@@ -75,7 +93,9 @@ public:
 	const long getTag();
 
 	/**
-	 *
+	 * Mark this fiber canceled, it's up to the fiber to check
+	 * isCanceled(). A fiber canceled before its first run still runs,
+	 * unless the scheduler drops such fibers by setDropCanceled().
 	 */
 	void cancel();
 
@@ -94,6 +114,43 @@ public:
 	 */
 	int getStackSize();
 
+	/**
+	 * Allow this fiber to run on a shared stack if the scheduler has
+	 * them (default false), it must be set before the fiber first runs.
+	 *
+	 * Note: a shared stack fiber's stack is copied away when it's off and
+	 * another fiber's is copied to the same addresses, so a pointer into
+	 * its stack reads or writes the wrong memory from other fibers. Only
+	 * opt in fibers which never hand out such pointers: no channel, mutex
+	 * or other object on their stack used by other fibers, no [&] lambda
+	 * scheduled from them.
+	 */
+	void setSharedStack(boolean on);
+	boolean isSharedStack();
+
+	/**
+	 * Set the priority class, a new fiber takes the one of the fiber
+	 * which creates it, else PRIORITY_NORMAL.
+	 */
+	void setPriority(Priority priority);
+	Priority getPriority();
+
+	/**
+	 * Set the deadline in milliseconds since the epoch, 0 for none. A new
+	 * fiber takes the one of the fiber which creates it. It only orders
+	 * fibers in the PRIORITY_DEADLINE policy of the scheduler.
+	 */
+	void setDeadline(llong deadline);
+	llong getDeadline();
+
+	/**
+	 * Set the group in [0, MAX_GROUPS) which the run time of this fiber is
+	 * charged to. A new fiber takes the one of the fiber which creates it,
+	 * else 0.
+	 */
+	void setGroup(int group);
+	int getGroup();
+
 	/**
 	 *
 	 */
@@ -134,6 +191,17 @@ public:
 	 */
 	static void yield();
 
+	/**
+	 * Yield the current fiber and switch to the given one directly, with
+	 * one context switch and no trip through the scheduler loop. The fiber
+	 * must have been woken on this thread by the current fiber and wait in
+	 * its run next slot, null for the one woken last. The current fiber is
+	 * requeued, or parked if it's BLOCKED or WAITING, as by yield().
+	 *
+	 * @return false if it was a plain yield(), the fiber runs in its turn then
+	 */
+	static boolean yieldTo(EFiber* fiber);
+
 	/**
 	 *
 	 */
@@ -158,6 +226,9 @@ protected:
 	friend class EFiberLocal;
 	template<typename E, typename LOCK>
 	friend class EFiberConcurrentQueue;
+	template<typename E>
+	friend class EFiberMpscQueue;
+	friend struct PriorityRuns;
 
 	/* Fiber state */
 	volatile State state;
@@ -172,6 +243,7 @@ protected:
 	int threadIndex; // 0 is the EScheduler join()'s thread
 
 	int stackSize;
+	boolean sharedStack;
 	EContext* context; /* Fiber's context */
 
 	sp<EFiber> parent; /* Keep parent for sub fiber */
@@ -179,17 +251,31 @@ protected:
 	EFiberScheduler* scheduler; /* Bound scheduler */
 	EIoWaiter* iowaiter; /* Bound iowaiter */
 
-	EFiberConcurrentQueue<EFiber>* boundQueue; /* Thread bound queue */
+	EFiberMpscQueue<EFiber>* boundQueue; /* Thread bound queue */
 	long boundThreadID;
 
 	EFiberBlocker* blocker;
 
 	boolean isIoWaitTimeout;
 	boolean canceled;
+	boolean expired; /* canceled by the scheduler's setCancelExpired(), never runs */
+
+	boolean pinned; /* locked in the thread by scheduleInheritThread() */
+	boolean movable; /* not ran yet or yielded with no pending wait */
+	boolean keyed; /* scheduled by scheduleWithKey() or a child of such one */
+	llong key; /* the key of scheduleWithKey() */
+
+	Priority priority;
+	llong readySince; /* when it was queued to its priority class, micros */
+	int readyClass; /* the priority class it was queued to, setPriority() may change since */
+	llong deadline; /* millis since the epoch, 0 if none */
+	int group; /* the fair share group */
+
+	llong waitingSince; /* when it began to wait for a file event */
 
 	es_hash_t* localValues;
 
-	EFiberConcurrentQueue<EFiber>::NODE* packing;
+	EFiberQueueNode<EFiber>* packing;
 
 	/**
 	 * Constructor
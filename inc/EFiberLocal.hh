@@ -34,7 +34,7 @@ public:
 
 	E get() {
 		EFiber* currFiber = EFiber::currentFiber();
-		if (!currFiber) {
+		if (!currFiber || !currFiber->localValues) {
 			return null;
 		}
 		return (E)(eso_hash_get(currFiber->localValues, &keyWrap, sizeof(this)));
@@ -45,12 +45,15 @@ public:
 		if (!currFiber) {
 			return null;
 		}
+		if (!currFiber->localValues) {
+			currFiber->localValues = eso_hash_make(1, NULL);
+		}
 		return (E)(eso_hash_set(currFiber->localValues, &keyWrap, sizeof(this), e));
 	}
 
 	E remove() {
 		EFiber* currFiber = EFiber::currentFiber();
-		if (!currFiber) {
+		if (!currFiber || !currFiber->localValues) {
 			return null;
 		}
 		return (E)(eso_hash_set(currFiber->localValues, &keyWrap, sizeof(this), NULL));
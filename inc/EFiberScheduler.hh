@@ -29,6 +29,10 @@ class EIoWaiter;
 class EFileContext;
 class EFileContextManager;
 class SchedulerStub;
+class SchedulerWorker;
+class EFiberStackProfiler;
+class ECpuSet;
+struct SchedulerLocal;
 
 class EFiberScheduler: public EObject {
 public:
@@ -57,6 +61,102 @@ public:
 	 */
 	typedef int fiber_schedule_balance_t(EFiber* fiber, int threadNums);
 
+	/**
+	 * Type of fiber schedule balancer which reads the thread loads by
+	 * scheduler->getThreadLoad().
+	 */
+	typedef int fiber_load_balance_t(EFiber* fiber, int threadNums, EFiberScheduler* scheduler);
+
+	/**
+	 * Built-in balancers, used when no balance callback is set.
+	 */
+	enum BalancePolicy {
+		BALANCE_ROUND_ROBIN = 0,
+		BALANCE_LEAST_LOADED = 1, // the lowest load of all threads
+		BALANCE_TWO_CHOICES = 2 // the lower load of two random threads
+	};
+
+	/**
+	 * How a scheduler thread picks the next fiber of its run queue.
+	 */
+	enum PriorityPolicy {
+		PRIORITY_FIFO = 0, // one queue in order, the fiber priority is ignored
+		PRIORITY_STRICT = 1, // the highest class first
+		PRIORITY_WEIGHTED = 2, // each class runs its weight of fibers in a round
+		PRIORITY_DEADLINE = 3, // the earliest deadline first, a fiber without one is due starvationMillis after it's queued
+		PRIORITY_FAIR_SHARE = 4 // fiber groups by weighted fair queuing of their run time, see setGroupWeight()
+	};
+
+	/**
+	 * Load signals of a scheduler thread, read without locks so they're
+	 * only hints.
+	 */
+	struct ThreadLoad {
+		int fibers; // live fibers bound to the thread
+		int queued; // fibers in its run queue
+		int queuedByPriority[EFiber::PRIORITY_CLASSES]; // ... of each class with a priority policy
+		int waiters; // io events and timers registered on its io waiter
+		int busyPermille; // recent busy time, sampled only by load-aware balancers
+
+		/**
+		 * The score compared by the built-in balancers, lower is better.
+		 */
+		llong score() const;
+	};
+
+	/**
+	 * When the loop polls io events without waiting between fiber runs,
+	 * it always polls when the run queue is empty.
+	 */
+	enum IoPollPolicy {
+		IO_POLL_EACH_RUN = 0, // before each fiber run
+		IO_POLL_BUDGET = 1, // after maxRuns fiber runs or maxMicros
+		IO_POLL_ADAPTIVE = 2 // the runs budget follows the ready events of each poll, up to maxRuns
+	};
+
+	/**
+	 * Placement of the threads of join(threadNums), linux only.
+	 */
+	enum ThreadAffinity {
+		AFFINITY_NONE = 0, // let the kernel place the threads
+		AFFINITY_CPU = 1, // thread i on the i-th cpu, round robin
+		AFFINITY_NUMA_NODE = 2, // thread i on the cpus of the i-th numa node, round robin
+		AFFINITY_CPUSET = 3 // all threads on all the cpus
+	};
+
+	/**
+	 * Scheduler statistics, summed over all scheduler threads.
+	 */
+	struct Stats {
+		llong hibernatedFibers;
+		llong hibernatedBytes;
+		llong trimmedFibers;
+		llong trimmedPages;
+		llong stolenFibers;
+		llong ioPolls; // polls between fiber runs
+		llong ioPollSkips; // fiber runs without a poll
+		llong idleSpinWakeups; // idle waits ended by new fibers while spinning
+		llong idleYieldWakeups; // ... while yielding the cpu
+		llong idleParks; // idle waits parked on the io waiter
+		llong wakeupsIssued; // cross-thread wakeups written to an io waiter
+		llong wakeupsSuppressed; // ... skipped as one was still pending
+		llong threadsGrown; // threads added by the elastic mode of start()
+		llong threadsRetired; // ... retired
+		llong priorityRuns[EFiber::PRIORITY_CLASSES]; // fiber runs of each class with a priority policy
+		llong priorityWaitMicros[EFiber::PRIORITY_CLASSES]; // ... their time in the run queue
+		llong priorityMaxWaitMicros[EFiber::PRIORITY_CLASSES]; // ... the longest one
+		llong starvedRuns; // runs of a lower class ahead of a higher one by the starvation limit
+		llong deadlinesMissed; // fibers first run after their deadline
+		llong deadlinesCanceled; // ... canceled instead, see setCancelExpired()
+		llong runNextRuns; // fibers run from the run next slot
+		llong directSwitches; // ... switched to from a fiber by EFiber::yieldTo()
+		llong groupRuns[EFiber::MAX_GROUPS]; // fiber runs of each group with PRIORITY_FAIR_SHARE
+		llong groupRunNanos[EFiber::MAX_GROUPS]; // ... their run time
+
+		Stats();
+		void add(const Stats& other);
+	};
+
 public:
 	virtual ~EFiberScheduler();
 
@@ -90,6 +190,45 @@ public:
 	virtual sp<EFiber> scheduleInheritThread(std::function<void()> f, int stackSize=1024*1024);
 #endif
 
+	/**
+	 * Add a new fiber to this scheduler with a deadline, see
+	 * EFiber::setDeadline() and PRIORITY_DEADLINE.
+	 */
+	virtual void schedule(sp<EFiber> fiber, EDate* deadline);
+
+#ifdef CPP11_SUPPORT
+	/**
+	 * Add a new lambda function as fiber to this scheduler (c++11)
+	 * with a deadline.
+	 */
+	virtual sp<EFiber> schedule(std::function<void()> f, EDate* deadline, int stackSize=1024*1024);
+#endif
+
+	/**
+	 * Add a new fiber to this scheduler on the thread of key, the same
+	 * key always goes to the same thread so the state of a key can be
+	 * kept per thread without locks. Fibers scheduled by a keyed fiber
+	 * take its key, and keyed fibers are never handed off.
+	 *
+	 * Keys are spread over the threads by a consistent hash, in the
+	 * elastic mode of start() over the minThreads which never retire.
+	 * It takes precedence over the balancers.
+	 */
+	virtual void scheduleWithKey(llong key, sp<EFiber> fiber);
+
+#ifdef CPP11_SUPPORT
+	/**
+	 * Add a new lambda function as fiber to this scheduler (c++11)
+	 * on the thread of key.
+	 */
+	virtual sp<EFiber> scheduleWithKey(llong key, std::function<void()> f, int stackSize=1024*1024);
+#endif
+
+	/**
+	 * The thread index which key is scheduled to.
+	 */
+	virtual int threadIndexOfKey(llong key);
+
 	/**
 	 * Add a new timer to this scheduler
 	 */
@@ -124,6 +263,10 @@ public:
 	/**
 	 * Set the callback for schedule balance
 	 *
+	 * threadNums is the current thread count, which changes in the elastic
+	 * mode of start(), the indices below it are always valid ones and an
+	 * index out of them is wrapped around.
+	 *
 	 * @param balancer if null then balance use rol-poling else use the callback return value
 	 */
 #ifdef CPP11_SUPPORT
@@ -132,18 +275,264 @@ public:
 	virtual void setBalanceCallback(fiber_schedule_balance_t* balancer);
 #endif
 
+	/**
+	 * Set the callback for schedule balance which may read the loads of
+	 * each thread by getThreadLoad(), it takes precedence over the one of
+	 * setBalanceCallback().
+	 */
+#ifdef CPP11_SUPPORT
+	virtual void setLoadBalanceCallback(std::function<int(EFiber* fiber, int threadNums, EFiberScheduler* scheduler)> balancer);
+#else
+	virtual void setLoadBalanceCallback(fiber_load_balance_t* balancer);
+#endif
+
+	/**
+	 * Set the built-in balancer used when no balance callback is set.
+	 */
+	virtual void setBalancePolicy(BalancePolicy policy);
+
+	/**
+	 * Get the load of a scheduler thread.
+	 *
+	 * @return false if the thread isn't there
+	 */
+	virtual boolean getThreadLoad(int threadIndex, ThreadLoad* load);
+
+	/**
+	 * Run fibers by their priority class, it takes effect on the next
+	 * join() or start(). A fiber of a lower class which has waited for
+	 * starvationMillis runs ahead of the higher classes, once in each
+	 * starvationMillis for each class.
+	 *
+	 * Fibers are sorted into the classes by the thread which runs them,
+	 * the queue is taken on each run so the cost is a clock read per run.
+	 */
+	virtual void setPriorityPolicy(PriorityPolicy policy, llong starvationMillis=100);
+
+	/**
+	 * Fibers of each class in a round of PRIORITY_WEIGHTED, >= 1.
+	 */
+	virtual void setPriorityWeights(int urgent=8, int normal=4, int background=1);
+
+	/**
+	 * The cpu share of a fiber group (EFiber::setGroup) with
+	 * PRIORITY_FAIR_SHARE, 1 by default. Each thread runs the queued
+	 * group with the least run time over weight charged on all threads,
+	 * the fibers of a group in order, so busy groups share the threads in
+	 * proportion to their weights and an idle group's share goes to the
+	 * others. A group which was idle starts from the run time of the last
+	 * pick, it can't save up its share.
+	 *
+	 * The run time is read around each fiber run, two clock reads a run.
+	 */
+	virtual void setGroupWeight(int group, int weight);
+
+	/**
+	 * Cancel the fibers of PRIORITY_DEADLINE which are within marginMillis
+	 * of their deadline or past it before they first run, they terminate
+	 * without running. Under overload the run queue wait grows up to the
+	 * deadline less the margin, so a margin of about the run time of a
+	 * fiber lets the ones which run finish in time.
+	 */
+	virtual void setCancelExpired(boolean on, llong marginMillis=0);
+
+	/**
+	 * Terminate a fiber canceled before its first run without running
+	 * it, so it never gets a context or a stack (default false, it runs
+	 * and may check EFiber::isCanceled() to clean up). A dropped fiber
+	 * gets no FIBER_BEFORE/FIBER_AFTER callbacks.
+	 */
+	virtual void setDropCanceled(boolean on);
+
+	/**
+	 * Set the caps of each scheduler thread's stack pool.
+	 *
+	 * @param maxStacksPerClass max cached stacks of each power-of-two size class
+	 * @param maxCachedBytes max cached bytes of each thread
+	 */
+	virtual void setStackPoolCapacity(int maxStacksPerClass, llong maxCachedBytes);
+
+	/**
+	 * Pre-fault n stacks of stackSize into each scheduler thread's
+	 * stack pool when join() starts, they commit n*stackSize bytes.
+	 */
+	virtual void prewarm(int n, int stackSize=1024*1024);
+
+	/**
+	 * Run fibers on count shared stacks of stackSize per scheduler thread
+	 * instead of private stacks, the live stack slice of a fiber is copied
+	 * to a right-sized heap buffer when another fiber takes the stack.
+	 *
+	 * It trades a memcpy per switch for far less memory of idle fibers,
+	 * fibers opt in by EFiber::setSharedStack(true), see there for the
+	 * pointers into a shared stack.
+	 */
+	virtual void setSharedStack(int count, int stackSize=8*1024*1024);
+
+	/**
+	 * Hibernate the private stacks of fibers which wait for a file event
+	 * longer than idleMillis: the used part of the stack is copied to a
+	 * compact heap buffer and all the stack pages are given back, they
+	 * are restored when the fiber is resumed.
+	 *
+	 * Note: the addresses of a hibernated stack stay mapped but not its
+	 * contents, until the fiber resumes other fibers read zeros there and
+	 * their writes are overwritten by the restore. Only enable it if no
+	 * fiber shares an object on its stack with others while it waits for
+	 * io, e.g. a channel or mutex, a [&] lambda captured variable.
+	 *
+	 * @param idleMillis <= 0 to disable (default)
+	 */
+	virtual void setStackHibernation(llong idleMillis);
+
+	/**
+	 * Give back the dirty stack pages below the stack pointer of fibers
+	 * parked on io or timer events every intervalMillis, e.g. the pages
+	 * left by a deep TLS handshake.
+	 *
+	 * @param intervalMillis <= 0 to disable (default)
+	 * @param minRssBytes only trim when the process RSS is over it, 0 always
+	 */
+	virtual void setStackTrimming(llong intervalMillis, llong minRssBytes=0);
+
+	/**
+	 * Size the stacks of named fibers (EFiber::setName) by the stack
+	 * high-water marks of earlier fibers of the same name: one of every
+	 * sampleRate fibers runs on its requested size and is measured at
+	 * termination, the others run on the largest mark plus marginPercent,
+	 * never more than requested. Only fibers on private stacks are
+	 * measured, none in the split stack build.
+	 *
+	 * @param sampleRate <= 0 to stop learning, learned sizes still apply
+	 */
+	virtual void setStackAutoSizing(int sampleRate=16, int marginPercent=50);
+
+	/**
+	 * Export the learned stack sizes as "<size> <name>" lines, to be
+	 * imported at the next startup.
+	 */
+	virtual EString exportStackProfile();
+	virtual void importStackProfile(const char* profile);
+
+	/**
+	 * Let idle threads of join(threadNums) take runnable fibers from busy
+	 * ones: fibers never ran, and fibers which yielded with no io event
+	 * or timer pending. Fibers of scheduleInheritThread() or on a shared
+	 * stack stay where they are.
+	 *
+	 * A busy thread hands a fiber to a thread sleeping on its io waiter
+	 * when it has more fibers queued, so each run queue is polled only by
+	 * its own thread.
+	 */
+	virtual void setWorkStealing(boolean on);
+
+	/**
+	 * A fiber woken by another fiber of its thread, by a channel or a
+	 * mutex, runs next ahead of the run queue while its caches are warm
+	 * (default on). The slot holds one fiber, a newer one moves the older
+	 * to the tail. After maxRuns fibers from the slot in a row the next
+	 * one goes to the tail too, so fibers waking each other in turn can't
+	 * starve the queue. Only with PRIORITY_FIFO.
+	 */
+	virtual void setRunNext(boolean on, int maxRuns=8);
+
+	/**
+	 * Set the io poll policy of the loop while there are io waiters,
+	 * IO_POLL_EACH_RUN by default, maxRuns and maxMicros are for the others.
+	 *
+	 * @param maxMicros <= 0 for no time budget
+	 */
+	virtual void setIoPollPolicy(IoPollPolicy policy, int maxRuns=64, llong maxMicros=200);
+
+	/**
+	 * Set what an idle thread of join(threadNums) does before it parks on
+	 * its io waiter: spin with cpu pause checking its run queue for
+	 * spinMicros, then check it between sched_yield() for yieldMicros.
+	 * A new fiber found then costs no wakeup of the thread.
+	 *
+	 * Both 0 to park at once (default).
+	 */
+	virtual void setIdlePolicy(llong spinMicros, llong yieldMicros);
+
+	/**
+	 * Pin the threads of join(threadNums) to cpus, the calling thread of
+	 * join() too until it returns. Each thread creates its own run queue
+	 * and io poller after it's pinned, and its stacks are touched first
+	 * by itself, so all of them are allocated on its numa node.
+	 *
+	 * @param cpuList cpus to place the threads on like "0-3,8", null for
+	 *        all the cpus of the process (the cgroup cpuset included)
+	 */
+	virtual void setThreadAffinity(ThreadAffinity affinity, const char* cpuList=null);
+
+	/**
+	 * Get the statistics, it's not exact while scheduler threads are running.
+	 */
+	virtual Stats getStats();
+
+	/**
+	 * Get the statistics of a thread of join(threadNums) or start(threadNums).
+	 */
+	virtual Stats getStats(int threadIndex);
+
 	/**
 	 * Do schedule and wait all fibers work done.
+	 *
+	 * If started, only wait all fibers work done, the threads go on.
 	 */
 	virtual void join();
 
 	/**
 	 * Do schedule with thread pool and wait all fibers work done.
 	 *
-	 * @param threadNums >= 1
+	 * If started, the same as join().
+	 *
+	 * @param threadNums >= 1, or 0 for availableProcessors()
 	 */
 	virtual void join(int threadNums);
 
+	/**
+	 * Start threadNums scheduler threads which keep running, the calling
+	 * thread is not one of them. Fibers can be scheduled from any thread
+	 * at any time, the threads wait for new fibers when all are done.
+	 *
+	 * @param threadNums >= 1, or 0 for availableProcessors()
+	 */
+	virtual void start(int threadNums);
+
+	/**
+	 * Start minThreads scheduler threads, up to maxThreads by load: a
+	 * thread is added when the run queue of a thread stays at least
+	 * growQueueDepth deep for growMicros and no thread is idle. The last
+	 * added thread retires after it's idle for shrinkMillis with no fiber
+	 * bound to it, fibers of scheduleInheritThread() or waiting for io
+	 * on it are never moved, it waits them finished.
+	 *
+	 * Threads keep their index, the thread count only grows and shrinks
+	 * at the end, see setBalanceCallback().
+	 */
+	virtual void start(int minThreads, int maxThreads);
+
+	/**
+	 * Set the thresholds of start(minThreads, maxThreads).
+	 *
+	 * @param growQueueDepth 1..32, sampled on each refill of the run batch
+	 */
+	virtual void setElasticPolicy(int growQueueDepth=8, llong growMicros=2000, llong shrinkMillis=5000);
+
+	/**
+	 * The current count of scheduler threads.
+	 */
+	virtual int getThreadCount();
+
+	/**
+	 * Wait all fibers work done, then stop the threads of start() and
+	 * free their run queues and io waiters. A fiber scheduled while it's
+	 * stopping waits the next start() or join().
+	 */
+	virtual void stop();
+	virtual boolean isStarted();
+
 	/**
 	 *
 	 */
@@ -155,6 +544,12 @@ public:
 	 */
 	virtual int totalFiberCount();
 
+	/**
+	 * The cpus this process may run on, within the cgroup cpuset and the
+	 * cgroup cpu quota rounded up.
+	 */
+	static int availableProcessors();
+
 	/**
 	 * Get current active fiber.
 	 */
@@ -173,17 +568,35 @@ public:
 
 private:
 	friend class EFiber;
+	friend class SchedulerWorker;
 
 	int maxEventSetSize;
-	int threadNums;
+	volatile int threadNums; // active threads of the elastic mode
 
-	EFiberConcurrentQueue<EFiber> defaultTaskQueue;
-	EA<SchedulerStub*>* schedulerStubs; // created only if threadNums > 1
+	EFiberMpscQueue<EFiber> defaultTaskQueue;
+	EA<SchedulerStub*>* schedulerStubs; // created only if threadNums > 1 or started
+	EAtomicCounter schedulingThreads; // threads of scheduleIgnoreBalance() reading schedulerStubs
 #ifdef CPP11_SUPPORT
 	std::function<int(EFiber* fiber, int threadNums)> balanceCallback;
 #else
 	fiber_schedule_balance_t* balanceCallback;
 #endif
+#ifdef CPP11_SUPPORT
+	std::function<int(EFiber* fiber, int threadNums, EFiberScheduler* scheduler)> loadBalanceCallback;
+#else
+	fiber_load_balance_t* loadBalanceCallback;
+#endif
+	BalancePolicy balancePolicy;
+	volatile boolean loadAware; // sample busy time for the balancers
+	PriorityPolicy priorityPolicy;
+	int priorityWeights[EFiber::PRIORITY_CLASSES];
+	int groupWeights[EFiber::MAX_GROUPS];
+	volatile llong groupVtimes[EFiber::MAX_GROUPS]; // run time over weight of each group, of all threads
+	llong starvationMillis;
+	boolean cancelExpired;
+	boolean dropCanceled;
+	llong expiryMarginMillis;
+	volatile int defaultPriorityQueued[EFiber::PRIORITY_CLASSES]; // class depths of join() without threads
 	EAtomicCounter balanceIndex;
 
 	EAtomicBoolean hasError;
@@ -191,6 +604,42 @@ private:
 
 	EFileContextManager* hookedFiles;
 
+	int stackPoolMaxStacks;
+	llong stackPoolMaxBytes;
+	int prewarmCount;
+	int prewarmStackSize;
+	int sharedStackCount;
+	int sharedStackSize;
+	llong hibernateMillis;
+	llong trimMillis;
+	llong trimMinRss;
+	EFiberStackProfiler* stackProfiler; // null if not auto sizing
+	boolean workStealing;
+	boolean runNextOn;
+	int runNextMaxRuns;
+	IoPollPolicy ioPollPolicy;
+	int ioPollRuns;
+	llong ioPollMicros;
+	llong idleSpinMicros;
+	llong idleYieldMicros;
+	EAtomicCounter idleThreads; // threads sleeping on their io waiter
+	ThreadAffinity threadAffinity;
+	EString threadCpuList;
+
+	EA<SchedulerWorker*>* workers; // threads of start() by index, null if not started
+	volatile boolean stopping;
+	EAtomicInteger placedThreads; // workers with their stub created
+	volatile boolean stubsReady;
+	ESynchronizeable drainSync; // notified when all fibers are done
+	int elasticMinThreads; // less than schedulerStubs->length() if elastic
+	int growQueueDepth;
+	llong growMicros;
+	llong shrinkMillis;
+	volatile boolean growing; // a thread is being added
+	ECpuSet* workerCpus; // to place added threads on
+
+	Stats defaultStats; // stats of join() without threads
+
 	volatile boolean interrupted;
 
 #ifdef CPP11_SUPPORT
@@ -204,6 +653,17 @@ private:
 	static EThreadLocalStorage currScheduler;
 	static EThreadLocalStorage currIoWaiter;
 
+	/**
+	 * Put a fiber woken by a fiber of its thread to the run next slot.
+	 */
+	static boolean runNext(sp<EFiber>* fiber);
+
+	/**
+	 * Switch from the current fiber to the one in the run next slot,
+	 * false if it's not the fiber or it can't be switched to directly.
+	 */
+	static boolean switchNext(EFiber* fiber);
+
 	/**
 	 *
 	 */
@@ -211,6 +671,37 @@ private:
 			EThread* currentThread);
 
 	void scheduleIgnoreBalance(sp<EFiber> fiber, boolean ignoreBalance);
+
+	void newContext(EFiber* fiber);
+	void profileStack(EFiber* fiber);
+
+	boolean isMovable(EFiber* fiber);
+	boolean handOff(sp<EFiber>* fiber, int index);
+	boolean spinForWork(SchedulerStub* stub);
+
+	boolean isIoPollDue(SchedulerLocal* local, Stats* stats);
+	void ioPolled(SchedulerLocal* local, int events, Stats* stats);
+
+	void maintainStacks(EIoWaiter* ioWaiter, SchedulerLocal* local, Stats* stats);
+
+	boolean placeThread(int index, ECpuSet* allowed);
+	void placeableCpus(ECpuSet* origin, ECpuSet* allowed);
+
+	EA<SchedulerWorker*>* startWorkers(EA<SchedulerStub*>* stubs, int from, int count, ECpuSet* allowed);
+	boolean publishStubs(EA<SchedulerStub*>* stubs, int workerCount);
+	boolean pushTo(SchedulerStub* stub, sp<EFiber>* fiber);
+	int balance(EFiber* fiber);
+	int keyedThreads();
+	int leastLoaded(int n);
+	int twoChoices(int n);
+	void sampleBusy(SchedulerLocal* local, SchedulerStub* stub, llong idleFrom);
+	void checkGrowth(SchedulerLocal* local, int depth, Stats* stats);
+	void threadAdded(int index);
+	boolean retireThread(SchedulerStub* stub, int index);
+	void dispatchTasks();
+	void retireStubs();
+	void awaitScheduling();
+	void awaitDrained();
 };
 
 } /* namespace eco */
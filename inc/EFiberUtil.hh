@@ -45,15 +45,21 @@ public:
 
 //=============================================================================
 
+/**
+ * The queue node each queued object carries as its "packing".
+ */
+template<typename E>
+struct EFiberQueueNode {
+	sp<E>* volatile value;
+	EFiberQueueNode* volatile next;
+
+	EFiberQueueNode(): value(null), next(null) {}
+};
+
 template<typename E, typename LOCK=SpinLock>
 class EFiberConcurrentQueue {
 public:
-	typedef struct node_t {
-	    sp<E>* volatile value;
-	    node_t* volatile next;
-
-	    node_t(): value(null), next(null) {}
-	} NODE;
+	typedef EFiberQueueNode<E> NODE;
 
 public:
 	~EFiberConcurrentQueue() {
@@ -95,6 +101,13 @@ public:
 		return v;
 	}
 
+	/**
+	 * Not exact if there are concurrent adds.
+	 */
+	boolean isEmpty() {
+		return head->next == null;
+	}
+
 private:
 	NODE *head;
 	NODE *tail;
@@ -104,6 +117,112 @@ private:
 
 //=============================================================================
 
+/**
+ * Dmitry Vyukov's intrusive multi-producer/single-consumer queue on the
+ * object's packing node: add() is one atomic exchange from any thread,
+ * poll() and drain() take no lock but only one thread may call them.
+ *
+ * @see: http://www.1024cores.net/home/lock-free-algorithms/queues/intrusive-mpsc-node-based-queue
+ */
+
+template<typename E>
+class EFiberMpscQueue {
+public:
+	typedef EFiberQueueNode<E> NODE;
+
+public:
+	EFiberMpscQueue(): head(&stub), tail(&stub), count(0) {
+	}
+
+	void add(sp<E>* e) {
+		NODE* node = (*e)->packing;
+		node->value = e;
+		__atomic_fetch_add(&count, 1, __ATOMIC_RELAXED);
+		push(node);
+	}
+
+	sp<E>* poll() {
+		NODE* node = pop();
+		if (!node) {
+			return null;
+		}
+		__atomic_fetch_sub(&count, 1, __ATOMIC_RELAXED);
+		return node->value;
+	}
+
+	/**
+	 * Poll max objects at most in one go.
+	 *
+	 * @return the number of objects
+	 */
+	int drain(sp<E>** items, int max) {
+		int n = 0;
+		NODE* node;
+		while (n < max && (node = pop()) != null) {
+			items[n++] = node->value;
+		}
+		if (n > 0) {
+			__atomic_fetch_sub(&count, n, __ATOMIC_RELAXED);
+		}
+		return n;
+	}
+
+	/**
+	 * Approximate count of objects, for any thread.
+	 */
+	int size() {
+		int n = __atomic_load_n(&count, __ATOMIC_RELAXED);
+		return (n > 0) ? n : 0; // an add's count may be seen after its poll
+	}
+
+	/**
+	 * Only for the consumer thread, not exact if there are concurrent adds.
+	 */
+	boolean isEmpty() {
+		return (tail == &stub && __atomic_load_n(&stub.next, __ATOMIC_ACQUIRE) == null);
+	}
+
+private:
+	NODE* volatile head; // producers' end
+	NODE* tail; // consumer's end
+	NODE stub;
+	volatile int count;
+
+	void push(NODE* node) {
+		node->next = null;
+		NODE* prev = __atomic_exchange_n(&head, node, __ATOMIC_ACQ_REL);
+		__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+	}
+
+	NODE* pop() {
+		NODE* t = tail;
+		NODE* next = __atomic_load_n(&t->next, __ATOMIC_ACQUIRE);
+		if (t == &stub) {
+			if (next == null) {
+				return null;
+			}
+			tail = t = next;
+			next = __atomic_load_n(&t->next, __ATOMIC_ACQUIRE);
+		}
+		if (next) {
+			tail = next;
+			return t;
+		}
+		if (t != __atomic_load_n(&head, __ATOMIC_ACQUIRE)) {
+			return null; // a producer is linking, try later.
+		}
+		push(&stub);
+		next = __atomic_load_n(&t->next, __ATOMIC_ACQUIRE);
+		if (next) {
+			tail = next;
+			return t;
+		}
+		return null;
+	}
+};
+
+//=============================================================================
+
 #define LOCKFOR(p) SpinLockPool<0>::lockFor(p)
 
 #define POLLSIZE 41
@@ -7,74 +7,57 @@
 
 #include "./EContext.hh"
 #include "../inc/EFiber.hh"
+#include "../inc/EFiberScheduler.hh"
 #include "../inc/EFiberDebugger.hh"
 
+#include <signal.h>
+#include <pthread.h>
+
 namespace efc {
 namespace eco {
 
-#if defined(__x86_64__)
-# if defined(__AVX__)
-#  define CLOBBER \
-        , "ymm0", "ymm1", "ymm2", "ymm3", "ymm4", "ymm5", "ymm6", "ymm7",\
-        "ymm8", "ymm9", "ymm10", "ymm11", "ymm12", "ymm13", "ymm14", "ymm15"
-# else
-#  define CLOBBER
-# endif
-
-# define SETJMP(ctx) ({\
-    int ret;\
-    asm("lea     LJMPRET%=(%%rip), %%rcx\n\t"\
-        "xor     %%rax, %%rax\n\t"\
-        "mov     %%rbx, (%%rdx)\n\t"\
-        "mov     %%rbp, 8(%%rdx)\n\t"\
-        "mov     %%r12, 16(%%rdx)\n\t"\
-        "mov     %%rsp, 24(%%rdx)\n\t"\
-        "mov     %%r13, 32(%%rdx)\n\t"\
-        "mov     %%r14, 40(%%rdx)\n\t"\
-        "mov     %%r15, 48(%%rdx)\n\t"\
-        "mov     %%rcx, 56(%%rdx)\n\t"\
-        "mov     %%rdi, 64(%%rdx)\n\t"\
-        "mov     %%rsi, 72(%%rdx)\n\t"\
-        "LJMPRET%=:\n\t"\
-        : "=a" (ret)\
-        : "d" (ctx)\
-        : "memory", "rcx", "r8", "r9", "r10", "r11",\
-          "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7",\
-          "xmm8", "xmm9", "xmm10", "xmm11", "xmm12", "xmm13", "xmm14", "xmm15"\
-          CLOBBER\
-          );\
-    ret;\
-})
-
-# define LONGJMP(ctx) \
-    asm("movq   (%%rax), %%rbx\n\t"\
-	    "movq   8(%%rax), %%rbp\n\t"\
-	    "movq   16(%%rax), %%r12\n\t"\
-	    "movq   24(%%rax), %%rdx\n\t"\
-	    "movq   32(%%rax), %%r13\n\t"\
-	    "movq   40(%%rax), %%r14\n\t"\
-	    "mov    %%rdx, %%rsp\n\t"\
-	    "movq   48(%%rax), %%r15\n\t"\
-	    "movq   56(%%rax), %%rdx\n\t"\
-	    "movq   64(%%rax), %%rdi\n\t"\
-	    "movq   72(%%rax), %%rsi\n\t"\
-	    "jmp    *%%rdx\n\t"\
-        : : "a" (ctx) : "rdx" \
-    )
+extern "C" {
+typedef ssize_t (*write_t)(int fd, const void *buf, size_t count);
+extern write_t write_f;
+
+#ifdef ECO_SPLIT_STACK
+//@see: libgcc/generic-morestack.c
+extern void* __splitstack_makecontext(size_t stack_size, void* context[10], size_t* size);
+extern void __splitstack_getcontext(void* context[10]);
+extern void __splitstack_setcontext(void* context[10]);
+extern void __splitstack_releasecontext(void* context[10]);
+extern void* __splitstack_resetcontext(void* context[10], size_t* size);
 #endif
+} //!C
 
 //=============================================================================
 
 EThreadLocalStorage EContext::threadLocal;
+EThreadLocalStorage EContext::altStackLocal;
+#ifdef ECO_SPLIT_STACK
+EThreadLocalStorage EContext::splitCacheLocal;
+
+// terminated fibers' split stack contexts, mmap/munmap of segments costs.
+static const int SPLIT_STACK_CACHE_SIZE = 256; // per-thread
+
+struct SplitStackCache {
+	int count;
+	void* contexts[SPLIT_STACK_CACHE_SIZE][10];
+};
+#endif
+
+static pthread_once_t guardOnce = PTHREAD_ONCE_INIT;
+static struct sigaction oldSegvAction;
+static struct sigaction oldBusAction;
 
 void* EContext::getOrignContext() {
-#ifdef __x86_64__
-	void* env = threadLocal.get();
-	if (!env) {
-		env = malloc(sizeof(es_uint64_t) * 10);
-		threadLocal.set(env);
+#ifdef ECO_HAVE_FCONTEXT
+	eco_fcontext_t* ofc = (eco_fcontext_t*)threadLocal.get();
+	if (!ofc) {
+		ofc = (eco_fcontext_t*)malloc(sizeof(eco_fcontext_t));
+		threadLocal.set(ofc);
 	}
-	return env;
+	return ofc;
 #else
 	ucontext_t* ctx = (ucontext_t*)threadLocal.get();
 	if (!ctx) {
@@ -86,10 +69,20 @@ void* EContext::getOrignContext() {
 }
 
 void EContext::cleanOrignContext() {
-#ifdef __x86_64__
-	void* env = threadLocal.get();
-	if (env) {
-		free(env);
+#ifdef ECO_SPLIT_STACK
+	SplitStackCache* cache = (SplitStackCache*)splitCacheLocal.get();
+	if (cache) {
+		for (int i = 0; i < cache->count; i++) {
+			__splitstack_releasecontext(cache->contexts[i]);
+		}
+		free(cache);
+		splitCacheLocal.set(NULL);
+	}
+#endif
+#ifdef ECO_HAVE_FCONTEXT
+	eco_fcontext_t* ofc = (eco_fcontext_t*)threadLocal.get();
+	if (ofc) {
+		free(ofc);
 		threadLocal.set(NULL);
 	}
 #else
@@ -101,18 +94,140 @@ void EContext::cleanOrignContext() {
 #endif
 }
 
+void EContext::installStackGuard() {
+	pthread_once(&guardOnce, &init_stack_guard);
+
+	// keep the thread's own alternate signal stack if it has one.
+	stack_t ss;
+	if (sigaltstack(NULL, &ss) == 0 && (ss.ss_flags & SS_DISABLE)) {
+		es_size_t size = ES_MAX(SIGSTKSZ, 64*1024);
+		ss.ss_sp = malloc(size);
+		ss.ss_size = size;
+		ss.ss_flags = 0;
+		if (sigaltstack(&ss, NULL) == 0) {
+			altStackLocal.set(ss.ss_sp);
+		} else {
+			free(ss.ss_sp);
+		}
+	}
+}
+
+void EContext::uninstallStackGuard() {
+	void* altStack = altStackLocal.get();
+	if (altStack) {
+		stack_t ss;
+		memset(&ss, 0, sizeof(ss));
+		ss.ss_flags = SS_DISABLE;
+		sigaltstack(&ss, NULL);
+		free(altStack);
+		altStackLocal.set(NULL);
+	}
+}
+
+void EContext::init_stack_guard() {
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = &stack_guard_handler;
+	sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGSEGV, &sa, &oldSegvAction);
+	sigaction(SIGBUS, &sa, &oldBusAction);
+}
+
+void EContext::stack_guard_handler(int sig, siginfo_t* info, void* uc) {
+	EFiber* fiber = EFiberScheduler::activeFiber();
+	EFiberStack* stack = (fiber && fiber->context) ? fiber->context->stack : null;
+	if (stack && stack->isGuardAddress(info->si_addr)) {
+		char msg[256];
+		int n = snprintf(msg, sizeof(msg),
+				"fiber#%d[%s] stack overflow, stack size: %d%s\n",
+				fiber->fid, fiber->getName(), stack->size(),
+				fiber->context->shared ? " (shared)" : "");
+		write_f(STDERR_FILENO, msg, ES_MIN(n, (int)sizeof(msg) - 1));
+	}
+
+	// chain to the old action.
+	struct sigaction* old = (sig == SIGBUS) ? &oldBusAction : &oldSegvAction;
+	if (old->sa_flags & SA_SIGINFO) {
+		old->sa_sigaction(sig, info, uc);
+	} else if (old->sa_handler != SIG_DFL && old->sa_handler != SIG_IGN) {
+		old->sa_handler(sig);
+	} else {
+		// the fault happens again with the default action.
+		sigaction(sig, old, NULL);
+	}
+}
+
 //=============================================================================
 
 EContext::~EContext() {
-	if (stackAddr) {
-		free(stackAddr);
-	}
+	unbindStack();
+#ifndef ECO_HAVE_FCONTEXT
 	if (context) {
 		free(context);
 	}
+#endif
 }
 
-EContext::EContext(EFiber* f): fiber(f) {
+EContext::EContext(EFiber* f): fiber(f), stack(null), errno_(0),
+		shared(null), hibernated(false), saveBuffer(null), saveSize(0), saveCapacity(0),
+		sampling(false), highWater(-1) {
+	/* the stack is bound on the first swapIn() by the thread runs it. */
+#ifndef ECO_HAVE_FCONTEXT
+	context = null;
+#endif
+#ifdef ECO_SPLIT_STACK
+	memset(splitContext, 0, sizeof(splitContext));
+	splitSegment = null;
+#endif
+}
+
+void EContext::bindStack() {
+#if defined(ECO_SPLIT_STACK)
+	size_t size;
+	SplitStackCache* cache = (SplitStackCache*)splitCacheLocal.get();
+	if (!cache) {
+		cache = (SplitStackCache*)malloc(sizeof(SplitStackCache));
+		cache->count = 0;
+		splitCacheLocal.set(cache);
+	}
+	if (cache->count > 0) {
+		memcpy(splitContext, cache->contexts[--cache->count], sizeof(splitContext));
+		splitSegment = __splitstack_resetcontext(splitContext, &size);
+	} else {
+		splitSegment = __splitstack_makecontext(SPLIT_STACK_SEGMENT_SIZE, splitContext, &size);
+	}
+	if (!splitSegment) {
+		throw ERuntimeException(__FILE__, __LINE__, "__splitstack_makecontext");
+	}
+	fctx = eco_make_fcontext((char*)splitSegment + size, size, &fiber_worker);
+#elif defined(ECO_HAVE_FCONTEXT)
+	if (fiber->sharedStack) {
+		shared = EFiberStackPool::bindShared(fiber->stackSize);
+	}
+	if (shared) {
+		// the initial frame is built after the occupant's slice is saved.
+		stack = shared->stack;
+		sampling = false;
+		return;
+	}
+
+	// mmap'ed pages are zero filled, the DEBUG build calcs max stack from it.
+	//@see: http://embeddedgurus.com/stack-overflow/2009/03/computing-your-stack-size/
+	stack = EFiberStackPool::allocate(fiber->stackSize);
+	if (sampling) {
+		// a pooled stack is dirty from its last fiber.
+		stack->decommit(stack->top());
+	}
+
+	/* build the initial frame by hand, no getcontext()/makecontext(). */
+	fctx = eco_make_fcontext(stack->top(), stack->size(), &fiber_worker);
+#else
+	stack = EFiberStackPool::allocate(fiber->stackSize);
+	if (sampling) {
+		stack->decommit(stack->top());
+	}
+
 	context = (ucontext_t*)malloc(sizeof(ucontext_t));
 
 	/* do a reasonable initialization */
@@ -126,53 +241,185 @@ EContext::EContext(EFiber* f): fiber(f) {
 		throw ERuntimeException(__FILE__, __LINE__, "getcontext");
 	}
 
-	int stackSize = fiber->stackSize;
-#ifdef DEBUG
-	stackAddr = (char*)calloc(1, stackSize); //for calc max stack.
-	//@see: http://embeddedgurus.com/stack-overflow/2009/03/computing-your-stack-size/
-#else
-	stackAddr = (char*)malloc(stackSize);
-#endif
-
 	/* call makecontext to do the real work. */
-	/* leave a few words open on both ends */
-	char* alignedAddr = (char*)ES_ALIGN_DEFAULT((llong)stackAddr);
-	context->uc_stack.ss_sp = alignedAddr; //memory aligned
-	context->uc_stack.ss_size = stackSize - (alignedAddr - stackAddr);
+	context->uc_stack.ss_sp = stack->bottom(); //page aligned
+	context->uc_stack.ss_size = stack->size();
 	context->uc_link = NULL;
 
 	makecontext(context, (void(*)(void))&fiber_worker, 1, fiber);
+#endif
+}
+
+void EContext::unbindStack() {
+#ifdef ECO_SPLIT_STACK
+	if (splitSegment) {
+		SplitStackCache* cache = (SplitStackCache*)splitCacheLocal.get();
+		if (cache && cache->count < SPLIT_STACK_CACHE_SIZE) {
+			memcpy(cache->contexts[cache->count++], splitContext, sizeof(splitContext));
+		} else {
+			__splitstack_releasecontext(splitContext);
+		}
+		splitSegment = null;
+	}
+#endif
+	if (shared) {
+		if (shared->occupant == this) {
+			shared->occupant = null;
+		}
+		EFiberStackPool::unbindShared(shared);
+		shared = null;
+	} else if (stack) {
+		EFiberStackPool::release(stack);
+	}
+	stack = null;
+
+	freeSlice();
+}
+
+void EContext::freeSlice() {
+	free(saveBuffer);
+	saveBuffer = null;
+	saveSize = saveCapacity = 0;
+	hibernated = false;
+}
+
+void EContext::setStackSampling(boolean on) {
+	sampling = on;
+}
+
+int EContext::getStackHighWater() {
+	return highWater;
+}
+
+boolean EContext::isThreadBound() {
+	return (shared != null);
+}
+
+void EContext::sampleStack() {
+	// pages decommitted later must not hide the mark.
+	if (sampling && stack && !shared) {
+		highWater = ES_MAX(highWater, (int)stack->usedBytes());
+	}
+}
+
+es_size_t EContext::hibernate() {
+#ifdef ECO_HAVE_FCONTEXT
+	// a shared stack fiber is compact already.
+	if (!stack || shared || hibernated) {
+		return 0;
+	}
+	sampleStack();
+	saveSlice();
+	hibernated = true;
+	// the range stays reserved so the addresses are the fiber's again on
+	// restore, but its contents are gone until then, see setStackHibernation().
+	return stack->decommit(stack->top());
+#else
+	return 0;
+#endif
+}
+
+void EContext::saveSlice() {
+#ifdef ECO_HAVE_FCONTEXT
+	// the saved fcontext is the stack pointer, [fctx, top) is all alive.
+	char* sp = (char*)fctx;
+	int n = stack->top() - sp;
+	if (n > saveCapacity || n < (saveCapacity >> 2)) {
+		// keep the buffer right-sized, idle fibers are the point.
+		int capacity = ES_ALIGN_UP(n, 256);
+		char* buf = (char*)realloc(saveBuffer, capacity);
+		if (!buf) {
+			throw ERuntimeException(__FILE__, __LINE__, "realloc");
+		}
+		saveBuffer = buf;
+		saveCapacity = capacity;
+	}
+	memcpy(saveBuffer, sp, n);
+	saveSize = n;
+#endif
+}
+
+void EContext::restoreSlice() {
+	memcpy(stack->top() - saveSize, saveBuffer, saveSize);
+}
+
+es_size_t EContext::trim() {
+#ifdef ECO_HAVE_FCONTEXT
+	if (!stack || shared || hibernated) {
+		return 0;
+	}
+	sampleStack();
+	// nothing below the saved context is alive.
+	return stack->decommit((char*)fctx);
+#else
+	return 0;
+#endif
 }
 
 boolean EContext::swapIn() {
+#ifdef ECO_SPLIT_STACK
+	if (!splitSegment) {
+		bindStack();
+	}
+#else
+	if (!stack) {
+		bindStack();
+	} else if (hibernated) {
+		restoreSlice();
+		freeSlice();
+	}
+#endif
+
+#ifdef ECO_HAVE_FCONTEXT
+	if (shared && shared->occupant != this) {
+		EContext* occupant = (EContext*)shared->occupant;
+		if (occupant) {
+			occupant->saveSlice();
+		}
+		if (saveSize == 0) { // never ran
+			fctx = eco_make_fcontext(stack->top(), stack->size(), &fiber_worker);
+		} else {
+			restoreSlice();
+		}
+		shared->occupant = this;
+	}
+#endif
+
 	// restore
 	errno = errno_;
 
-#ifdef __x86_64__
-	/* use setcontext() for the initial jump, as it allows us to set up
-	 * a stack, but continue with longjmp() as it's much faster.
-	 */
-	if (SETJMP(getOrignContext()) == 0) {
-		/* context just be used once for set up a stack, which will
-		 * be freed in fiber_worker.
-		 */
-		if (context != NULL)
-			setcontext(context);
-		else
-			LONGJMP(env);
-	}
-	return true;
+	// the context swapped out at last, another one after switchTo().
+	EContext* last;
+#if defined(ECO_SPLIT_STACK)
+	// nothing may grow the stack between the two setcontext.
+	void* orignSplitContext[10];
+	__splitstack_getcontext(orignSplitContext);
+	__splitstack_setcontext(splitContext);
+	last = (EContext*)eco_jump_fcontext((eco_fcontext_t*)getOrignContext(), fctx, fiber);
+	__splitstack_setcontext(orignSplitContext);
+	boolean r = true;
+#elif defined(ECO_HAVE_FCONTEXT)
+	last = (EContext*)eco_jump_fcontext((eco_fcontext_t*)getOrignContext(), fctx, fiber);
+	boolean r = true;
 #else
-	return (swapcontext((ucontext_t*)getOrignContext(), context) == 0);
+	boolean r = (swapcontext((ucontext_t*)getOrignContext(), context) == 0);
+	last = this;
 #endif
+
+	// give back the stack to this thread's pool as soon as possible.
+	if (last->fiber->state == EFiber::TERMINATED) {
+		last->sampleStack();
+		last->unbindStack();
+	}
+	return r;
 }
 
 boolean EContext::swapOut() {
 #ifdef DEBUG
 	//calc max stack size!!!
-	if (EFiberDebugger::getInstance().isDebugOn(EFiberDebugger::FIBER)) {
-		char* pcurr = stackAddr;
-		char* pend = stackAddr + fiber->stackSize;
+	if (stack && !shared && EFiberDebugger::getInstance().isDebugOn(EFiberDebugger::FIBER)) {
+		char* pcurr = stack->bottom();
+		char* pend = stack->top();
 		while (pcurr < pend && *pcurr++ == 0) {
 		}
 		int n = pend - pcurr;
@@ -183,26 +430,43 @@ boolean EContext::swapOut() {
 	//keep it
 	errno_ = errno;
 
-#ifdef __x86_64__
-	if (SETJMP(env) == 0) {
-		LONGJMP(getOrignContext());
-	}
+#ifdef ECO_SPLIT_STACK
+	__splitstack_getcontext(splitContext);
+#endif
+
+#ifdef ECO_HAVE_FCONTEXT
+	eco_jump_fcontext(&fctx, *(eco_fcontext_t*)getOrignContext(), this);
 	return true;
 #else
 	return (swapcontext(context, (ucontext_t*)getOrignContext()) == 0);
 #endif
 }
 
-void EContext::fiber_worker(void* arg) {
-	EFiber* fiber = (EFiber*)arg;
+boolean EContext::canSwitchTo(EContext* next) {
+#if defined(ECO_HAVE_FCONTEXT) && !defined(ECO_SPLIT_STACK)
+	// a shared stack holds one live slice, the jump back to it is the loop's.
+	return (next != this && next->stack && !shared && !next->shared);
+#else
+	return false;
+#endif
+}
 
-#ifdef __x86_64__
-	/* when using setjmp/longjmp, the context just be used only once */
-	if (fiber->context->context != NULL) {
-		free(fiber->context->context);
-		fiber->context->context = NULL;
+void EContext::switchTo(EContext* next) {
+#if defined(ECO_HAVE_FCONTEXT) && !defined(ECO_SPLIT_STACK)
+	errno_ = errno;
+
+	if (next->hibernated) {
+		next->restoreSlice();
+		next->freeSlice();
 	}
+	errno = next->errno_;
+
+	eco_jump_fcontext(&fctx, next->fctx, next->fiber);
 #endif
+}
+
+void EContext::fiber_worker(void* arg) {
+	EFiber* fiber = (EFiber*)arg;
 
 	try {
 
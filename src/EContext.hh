@@ -15,8 +15,26 @@
 #endif
 
 #include "Efc.hh"
+#include "./EFiberStack.hh"
+#include "./eco_fcontext.h"
 
+#include <signal.h>
+#ifndef ECO_HAVE_FCONTEXT
 #include <ucontext.h>
+#endif
+
+/*
+ * ECO_SPLIT_STACK: build with gcc -fsplit-stack -DECO_SPLIT_STACK, fibers
+ * start on a small stack segment and grow on demand by gcc's __morestack.
+ */
+#ifdef ECO_SPLIT_STACK
+#if !defined(__linux__) || !defined(__GNUC__) || !(defined(__x86_64__) || defined(__i386__))
+#error "ECO_SPLIT_STACK needs gcc -fsplit-stack on linux x86/x86_64."
+#endif
+#define ECO_NO_SPLIT_STACK __attribute__((no_split_stack))
+#else
+#define ECO_NO_SPLIT_STACK
+#endif
 
 namespace efc {
 namespace eco {
@@ -33,27 +51,110 @@ public:
 
 	EContext(EFiber* fiber);
 
-	boolean swapIn();
-	boolean swapOut();
+	boolean swapIn() ECO_NO_SPLIT_STACK;
+	boolean swapOut() ECO_NO_SPLIT_STACK;
+
+	/**
+	 * Test if the running fiber of this context can jump to the parked
+	 * one of next by switchTo(), not with a shared stack or ucontext.
+	 */
+	boolean canSwitchTo(EContext* next);
+
+	/**
+	 * Park the running fiber of this context and resume next's directly,
+	 * the jump back to the scheduler is made by the last one resumed.
+	 */
+	void switchTo(EContext* next);
+
+	/**
+	 * Copy the live slice of a parked fiber's private stack out and give
+	 * all its pages back, it's copied back on the next swapIn().
+	 *
+	 * @return resident bytes released, 0 if not hibernated
+	 */
+	es_size_t hibernate();
+
+	/**
+	 * Give back the dirty pages below the saved stack pointer of a
+	 * parked fiber's private stack.
+	 *
+	 * @return resident bytes released
+	 */
+	es_size_t trim();
+
+	/**
+	 * Bind a clean private stack and measure its high-water mark,
+	 * call it before the first swapIn().
+	 */
+	void setStackSampling(boolean on);
+
+	/**
+	 * The high-water mark of a sampled stack, -1 if not measured.
+	 */
+	int getStackHighWater();
+
+	/**
+	 * Test if the fiber's live stack is on its thread's shared stack,
+	 * such a fiber can't move to another thread.
+	 */
+	boolean isThreadBound();
 
 	static inline void* getOrignContext();
 	static void cleanOrignContext();
 
+	/**
+	 * Report stack overflow of the active fiber on SIGSEGV/SIGBUS,
+	 * the handler runs on a per-thread alternate signal stack.
+	 */
+	static void installStackGuard();
+	static void uninstallStackGuard();
+
 private:
 	friend class EFiber;
 
-#ifdef __x86_64__
-	es_uint64_t env[10];
-#endif
+#ifdef ECO_HAVE_FCONTEXT
+	eco_fcontext_t fctx;
+#else
 	ucontext_t* context;
+#endif
 
 	EFiber* fiber;
-	char* stackAddr; /* Base of stack's allocated memory */
+	EFiberStack* stack; // own stack or the bound shared stack, null before the first swapIn
 	int errno_; /* Global errno */
 
+#ifdef ECO_SPLIT_STACK
+	static const int SPLIT_STACK_SEGMENT_SIZE = 8192; // the first segment
+	void* splitContext[10];
+	void* splitSegment;
+#endif
+
+	/* Copy-on-switch: the slice of a shared stack fiber when it's off,
+	 * or of a hibernated fiber */
+	EFiberSharedStack* shared;
+	boolean hibernated;
+	char* saveBuffer;
+	int saveSize;
+	int saveCapacity;
+
+	boolean sampling;
+	int highWater;
+
 	static EThreadLocalStorage threadLocal;
+	static EThreadLocalStorage altStackLocal;
+#ifdef ECO_SPLIT_STACK
+	static EThreadLocalStorage splitCacheLocal;
+#endif
+
+	void bindStack();
+	void unbindStack();
+	void saveSlice();
+	void restoreSlice();
+	void freeSlice();
+	void sampleStack();
 
 	static void fiber_worker(void* arg);
+	static void init_stack_guard();
+	static void stack_guard_handler(int sig, siginfo_t* info, void* uc);
 };
 
 } /* namespace eco */
@@ -0,0 +1,226 @@
+/*
+ * ECpuSet.cpp
+ *
+ *  Created on: 2026-10-16
+ *      Author: agent@local
+ */
+
+#include "./ECpuSet.hh"
+
+#include <stdio.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+namespace efc {
+namespace eco {
+
+/**
+ * Read the first line of a small file, false if it's not there.
+ */
+static boolean readLine(const char* path, char* buf, int size) {
+	FILE* fp = fopen(path, "r");
+	if (!fp) {
+		return false;
+	}
+	boolean ok = (fgets(buf, size, fp) != NULL);
+	fclose(fp);
+	return ok;
+}
+
+ECpuSet::ECpuSet() {
+	memset(bits, 0, sizeof(bits));
+}
+
+void ECpuSet::add(int cpu) {
+	if (cpu >= 0 && cpu < MAX_CPUS) {
+		bits[cpu / 64] |= ((es_uint64_t)1 << (cpu % 64));
+	}
+}
+
+boolean ECpuSet::contains(int cpu) {
+	if (cpu < 0 || cpu >= MAX_CPUS) {
+		return false;
+	}
+	return (bits[cpu / 64] & ((es_uint64_t)1 << (cpu % 64))) != 0;
+}
+
+boolean ECpuSet::isEmpty() {
+	return count() == 0;
+}
+
+int ECpuSet::count() {
+	int n = 0;
+	for (int i = 0; i < MAX_CPUS / 64; i++) {
+		n += __builtin_popcountll(bits[i]);
+	}
+	return n;
+}
+
+int ECpuSet::get(int n) {
+	for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+		if (contains(cpu) && n-- == 0) {
+			return cpu;
+		}
+	}
+	return -1;
+}
+
+void ECpuSet::retain(ECpuSet& other) {
+	for (int i = 0; i < MAX_CPUS / 64; i++) {
+		bits[i] &= other.bits[i];
+	}
+}
+
+boolean ECpuSet::parse(const char* list) {
+	const char* p = list;
+	while (*p && *p != '\n') {
+		char* end;
+		long lo = strtol(p, &end, 10);
+		if (end == p || lo < 0) {
+			return false;
+		}
+		long hi = lo;
+		p = end;
+		if (*p == '-') {
+			p++;
+			hi = strtol(p, &end, 10);
+			if (end == p || hi < lo) {
+				return false;
+			}
+			p = end;
+		}
+		for (long cpu = lo; cpu <= hi && cpu < MAX_CPUS; cpu++) {
+			add((int)cpu);
+		}
+		if (*p == ',') {
+			p++;
+		} else if (*p && *p != '\n') {
+			return false;
+		}
+	}
+	return true;
+}
+
+boolean ECpuSet::bindCurrentThread() {
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu = 0; cpu < MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+		if (contains(cpu)) {
+			CPU_SET(cpu, &set);
+		}
+	}
+	return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+	return false;
+#endif
+}
+
+ECpuSet ECpuSet::ofCurrentThread() {
+	ECpuSet cpus;
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		for (int cpu = 0; cpu < MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &set)) {
+				cpus.add(cpu);
+			}
+		}
+		return cpus;
+	}
+#endif
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	for (long cpu = 0; cpu < n; cpu++) {
+		cpus.add((int)cpu);
+	}
+	return cpus;
+}
+
+ECpuSet ECpuSet::ofNumaNode(int node) {
+	ECpuSet cpus;
+#ifdef __linux__
+	char path[128];
+	char line[4096];
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	if (readLine(path, line, sizeof(line))) {
+		cpus.parse(line);
+	}
+#endif
+	return cpus;
+}
+
+int ECpuSet::numaNodes() {
+#ifdef __linux__
+	char line[256];
+	if (readLine("/sys/devices/system/node/online", line, sizeof(line))) {
+		ECpuSet nodes; // the same list format
+		if (nodes.parse(line) && !nodes.isEmpty()) {
+			return nodes.get(nodes.count() - 1) + 1;
+		}
+	}
+#endif
+	return 0;
+}
+
+int ECpuSet::cpuQuota() {
+#ifdef __linux__
+	char line[256];
+	llong quota = -1;
+	llong period = 0;
+
+	// cgroup v2: "<quota|max> <period>" of the process' own group or the root.
+	char path[512];
+	char group[256];
+	FILE* fp = fopen("/proc/self/cgroup", "r");
+	if (fp) {
+		path[0] = 0;
+		while (fgets(group, sizeof(group), fp)) {
+			if (strncmp(group, "0::", 3) == 0) {
+				group[strcspn(group, "\n")] = 0;
+				snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", group + 3);
+				break;
+			}
+		}
+		fclose(fp);
+		if (path[0] && !readLine(path, line, sizeof(line))) {
+			path[0] = 0;
+		}
+		if (path[0] || readLine("/sys/fs/cgroup/cpu.max", line, sizeof(line))) {
+			if (strncmp(line, "max", 3) == 0) {
+				return -1;
+			}
+			if (sscanf(line, "%lld %lld", &quota, &period) != 2) {
+				quota = -1;
+			}
+		}
+	}
+
+	// cgroup v1
+	if (quota < 0 && readLine("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", line, sizeof(line))) {
+		quota = atoll(line);
+		if (readLine("/sys/fs/cgroup/cpu/cpu.cfs_period_us", line, sizeof(line))) {
+			period = atoll(line);
+		}
+	}
+
+	if (quota > 0 && period > 0) {
+		return (int)((quota + period - 1) / period);
+	}
+#endif
+	return -1;
+}
+
+int ECpuSet::availableProcessors() {
+	int n = ofCurrentThread().count();
+	int quota = cpuQuota();
+	if (quota > 0 && quota < n) {
+		n = quota;
+	}
+	return ES_MAX(n, 1);
+}
+
+} /* namespace eco */
+} /* namespace efc */
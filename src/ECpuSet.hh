@@ -0,0 +1,84 @@
+/*
+ * ECpuSet.hh
+ *
+ *  Created on: 2026-10-16
+ *      Author: agent@local
+ */
+
+#ifndef ECPUSET_HH_
+#define ECPUSET_HH_
+
+#include "Efc.hh"
+
+namespace efc {
+namespace eco {
+
+/**
+ * A set of cpu ids for thread placement, only enforced on linux.
+ */
+
+class ECpuSet {
+public:
+	static const int MAX_CPUS = 1024;
+
+	ECpuSet();
+
+	void add(int cpu);
+	boolean contains(int cpu);
+	boolean isEmpty();
+	int count();
+
+	/**
+	 * The n-th cpu of this set in ascending order, -1 if none.
+	 */
+	int get(int n);
+
+	/**
+	 * Keep only the cpus in other.
+	 */
+	void retain(ECpuSet& other);
+
+	/**
+	 * Add the cpus of a list like "0-3,8,10-11".
+	 *
+	 * @return false if the list is malformed
+	 */
+	boolean parse(const char* list);
+
+	/**
+	 * Bind the calling thread to this set.
+	 */
+	boolean bindCurrentThread();
+
+	/**
+	 * The cpus the calling thread may run on, the cgroup cpuset included.
+	 */
+	static ECpuSet ofCurrentThread();
+
+	/**
+	 * The cpus of a numa node, empty if there's no such node.
+	 */
+	static ECpuSet ofNumaNode(int node);
+
+	/**
+	 * The count of numa nodes, 0 if unknown.
+	 */
+	static int numaNodes();
+
+	/**
+	 * The cpus of the cgroup cpu quota rounded up, -1 if unlimited.
+	 */
+	static int cpuQuota();
+
+	/**
+	 * The cpus of the calling thread capped by the cgroup cpu quota, >= 1.
+	 */
+	static int availableProcessors();
+
+private:
+	es_uint64_t bits[MAX_CPUS / 64];
+};
+
+} /* namespace eco */
+} /* namespace efc */
+#endif /* ECPUSET_HH_ */
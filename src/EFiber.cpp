@@ -32,17 +32,19 @@ EFiber::~EFiber() {
 	/*
 	 * call back for user has a chance to free all fiber local data.
 	 */
-	es_hash_index_t *hi;
-	void *key;
-	void *val;
-	for (hi = eso_hash_first(localValues); hi; hi = eso_hash_next(hi)) {
-		eso_hash_this(hi, &key, NULL, &val);
-		EFiberLocalKeyWrap* kw = (EFiberLocalKeyWrap*)key;
-		if (kw) {
-			kw->callback(val);
+	if (localValues) {
+		es_hash_index_t *hi;
+		void *key;
+		void *val;
+		for (hi = eso_hash_first(localValues); hi; hi = eso_hash_next(hi)) {
+			eso_hash_this(hi, &key, NULL, &val);
+			EFiberLocalKeyWrap* kw = (EFiberLocalKeyWrap*)key;
+			if (kw) {
+				kw->callback(val);
+			}
 		}
+		eso_hash_free(&localValues);
 	}
-	eso_hash_free(&localValues);
 	ECO_DEBUG(EFiberDebugger::FIBER, "delete fiber#%d", fid);
 }
 
@@ -51,6 +53,7 @@ EFiber::EFiber(int size):
 		fid(idCounter++),
 		tag(ES_LONG_MIN_VALUE),
 		stackSize(ES_MAX(size, MIN_STACK_SIZE)),
+		sharedStack(false),
 		context(null),
 		scheduler(null),
 		iowaiter(null),
@@ -59,13 +62,29 @@ EFiber::EFiber(int size):
 		blocker(null),
 		isIoWaitTimeout(false),
 		canceled(false),
+		expired(false),
+		pinned(false),
+		movable(true),
+		keyed(false),
+		key(0),
+		priority(PRIORITY_NORMAL),
+		readySince(0),
+		readyClass(PRIORITY_NORMAL),
+		deadline(0),
+		group(0),
+		waitingSince(0),
 		packing(null),
 		threadIndex(0) {
 	EFiber* cf = currentFiber();
-	if (cf) parent = cf->shared_from_this();
-	context = new EContext(this);
-	localValues = eso_hash_make(1, NULL);
-	packing = new EFiberConcurrentQueue<EFiber>::NODE();
+	if (cf) {
+		parent = cf->shared_from_this();
+		priority = cf->priority;
+		deadline = cf->deadline;
+		group = cf->group;
+	}
+	// context and local values are created on demand.
+	localValues = null;
+	packing = new EFiberQueueNode<EFiber>();
 	ECO_DEBUG(EFiberDebugger::FIBER, "new fiber#%d: %d", fid, stackSize);
 }
 
@@ -85,6 +104,33 @@ const long EFiber::getTag() {
 	return tag;
 }
 
+void EFiber::setPriority(Priority priority) {
+	this->priority = priority;
+}
+
+EFiber::Priority EFiber::getPriority() {
+	return priority;
+}
+
+void EFiber::setDeadline(llong deadline) {
+	this->deadline = deadline;
+}
+
+llong EFiber::getDeadline() {
+	return deadline;
+}
+
+void EFiber::setGroup(int group) {
+	if (group < 0 || group >= MAX_GROUPS) {
+		throw EIllegalArgumentException(__FILE__, __LINE__, "group out of range");
+	}
+	this->group = group;
+}
+
+int EFiber::getGroup() {
+	return group;
+}
+
 void EFiber::cancel() {
 	canceled = true;
 }
@@ -101,6 +147,14 @@ int EFiber::getStackSize() {
 	return stackSize;
 }
 
+void EFiber::setSharedStack(boolean on) {
+	this->sharedStack = on;
+}
+
+boolean EFiber::isSharedStack() {
+	return sharedStack;
+}
+
 int EFiber::getId() {
 	return fid;
 }
@@ -134,6 +188,14 @@ void EFiber::yield() {
 	}
 }
 
+boolean EFiber::yieldTo(EFiber* fiber) {
+	if (EFiberScheduler::switchNext(fiber)) {
+		return true;
+	}
+	yield();
+	return false;
+}
+
 EString EFiber::toString() {
 	return EString::formatOf("Fiber[%s,%d,%s,%d]", getName(), getId(), StateName[state], stackSize);
 }
@@ -199,6 +261,9 @@ void EFiber::swapIn() {
 	if (state == EFiber::WAITING || state == EFiber::BLOCKED) {
 		blocker = null;
 		state = EFiber::RUNNABLE;
+		if (EFiberScheduler::runNext(this->packing->value)) {
+			return; // woken by a fiber of its thread.
+		}
 		boundQueue->add(this->packing->value);
 
 		if (EThread::currentThread()->getId() != boundThreadID
@@ -46,7 +46,7 @@ void EFiberBlocker::wait() {
 
 		fiber->blocker = this;
 		fiber->state = EFiber::BLOCKED; // will be hang!
-		EFiber::yield();
+		EFiber::yieldTo(null); // to the fiber woken just before if any.
 	} else {
 		// waiter is a thread.
 		SYNCHRONIZED(sync_.get()) {
@@ -97,7 +97,7 @@ boolean EFiberBlocker::tryWait(llong time, ETimeUnit* unit) {
 
 		fiber->blocker = this;
 		fiber->state = EFiber::BLOCKED; // will be hang!
-		EFiber::yield();
+		EFiber::yieldTo(null); // to the fiber woken just before if any.
 
 		if (timerID != -1) {
 			ioWaiter->cancelTimer(timerID);
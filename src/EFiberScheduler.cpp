@@ -6,6 +6,8 @@
  */
 
 #include "./EContext.hh"
+#include "./EFiberStack.hh"
+#include "./ECpuSet.hh"
 #include "./EIoWaiter.hh"
 #include "./EFileContext.hh"
 #include "../inc/EFiberScheduler.hh"
@@ -14,6 +16,10 @@
 #include "../inc/EFiberDebugger.hh"
 
 #include <sys/resource.h>
+#include <fcntl.h>
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif
 
 namespace efc {
 namespace eco {
@@ -28,6 +34,45 @@ static long fdLimit(int deflim) {
 	return (limit < 0 ? deflim : rlim.rlim_cur);
 }
 
+static inline void cpuRelax() {
+#if defined(__i386__) || defined(__x86_64__)
+	__asm__ __volatile__("pause");
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static llong residentSetSize() {
+#ifdef __linux__
+	char buf[64];
+	int fd = ::open("/proc/self/statm", O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	int n = ::read(fd, buf, sizeof(buf) - 1);
+	::close(fd);
+	if (n <= 0) {
+		return -1;
+	}
+	buf[n] = 0;
+	long size, resident;
+	if (sscanf(buf, "%ld %ld", &size, &resident) != 2) {
+		return -1;
+	}
+	return (llong)resident * sysconf(_SC_PAGESIZE);
+#elif defined(__APPLE__)
+	mach_task_basic_info_data_t info;
+	mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+	if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO,
+			(task_info_t)&info, &count) != KERN_SUCCESS) {
+		return -1;
+	}
+	return info.resident_size;
+#else
+	return -1;
+#endif
+}
+
 //=============================================================================
 
 EThreadLocalStorage EFiberScheduler::currScheduler;
@@ -35,19 +80,548 @@ EThreadLocalStorage EFiberScheduler::currIoWaiter;
 
 class SchedulerStub: public EObject {
 public:
-	EFiberConcurrentQueue<EFiber> taskQueue;
+	EFiberMpscQueue<EFiber> taskQueue;
 	EIoWaiter ioWaiter;
 	EIoWaiter* volatile hungIoWaiter;
+	volatile boolean spinning; // idle but not parked
+	EAtomicCounter boundFibers; // fibers whose boundQueue is taskQueue
+	EAtomicCounter pushers; // threads adding to taskQueue in the elastic mode
+	volatile boolean retired; // no more fibers to be added
+	volatile int busyPermille; // moving average of the busy time
+	volatile int priorityQueued[EFiber::PRIORITY_CLASSES]; // depths of the priority classes
+	EFiberScheduler::Stats stats;
 	SchedulerStub(int maxEventSetSize) :
-			ioWaiter(maxEventSetSize), hungIoWaiter(null) {
+			ioWaiter(maxEventSetSize), hungIoWaiter(null), spinning(false),
+			retired(false), busyPermille(0) {
+		memset((void*)priorityQueued, 0, sizeof(priorityQueued));
 	}
 };
 
+/**
+ * A scheduler thread of join(threadNums) or start(threadNums), it creates
+ * its stub after it's placed and runs fibers once all stubs are there.
+ */
+class SchedulerWorker: public EThread {
+public:
+	SchedulerWorker(EFiberScheduler* s, EA<SchedulerStub*>* ss, int i, ECpuSet* a) :
+			scheduler(s), stubs(ss), index(i), allowed(a) {
+	}
+	virtual void run() {
+		try {
+			scheduler->placeThread(index, allowed);
+			if (!stubs->getAt(index)) {
+				stubs->setAt(index, new SchedulerStub(scheduler->maxEventSetSize));
+			}
+		} catch (...) {
+			scheduler->hasError.set(true);
+		}
+		if (index >= scheduler->threadNums) {
+			// added by the elastic mode.
+			scheduler->threadAdded(index);
+		} else {
+			scheduler->placedThreads.incrementAndGet();
+		}
+		while (!__atomic_load_n(&scheduler->stubsReady, __ATOMIC_ACQUIRE)) {
+			EThread::yield();
+		}
+		if (scheduler->hasError.get()) {
+			return;
+		}
+		try {
+			scheduler->joinWithThreadBind(stubs, index, this);
+		} catch (...) {
+			scheduler->hasError.set(true);
+		}
+	}
+private:
+	EFiberScheduler* scheduler;
+	EA<SchedulerStub*>* stubs;
+	int index;
+	ECpuSet* allowed; // only used before placedThreads is counted
+};
+
+struct RunBatch;
+
 struct SchedulerLocal {
 	EFiberScheduler* scheduler;
 	EFiber* currFiber;
 
-	SchedulerLocal(EFiberScheduler* fs): scheduler(fs), currFiber(null) {}
+	// io poll budget
+	int pollRuns; // fiber runs since the last poll
+	int pollBudget;
+	llong lastPollTime;
+
+	// stack maintenance
+	int maintainTicks;
+	llong nextHibernateTime;
+	llong nextTrimTime;
+
+	// elastic mode
+	llong backlogSince; // run queue deep since, micros
+	llong idleSince; // millis
+
+	// load-aware balance
+	llong busySince; // start of the busy time window, micros
+	llong idleMicros; // idle time in the window
+
+	// run next slot
+	RunBatch* runBatch; // null if the slot is off
+	EFiberMpscQueue<EFiber>* runQueue;
+
+	SchedulerLocal(EFiberScheduler* fs): scheduler(fs), currFiber(null),
+			pollRuns(0), pollBudget(1), lastPollTime(0),
+			maintainTicks(0), nextHibernateTime(0), nextTrimTime(0),
+			backlogSince(0), idleSince(0), busySince(0), idleMicros(0),
+			runBatch(null), runQueue(null) {}
+};
+
+/**
+ * Run queues of a scheduler thread by priority class, by deadline or by
+ * fiber group. The thread moves its task queue into them on each pick so
+ * an urgent fiber added by any thread is seen before the next run.
+ */
+struct PriorityRuns {
+	typedef EFiberQueueNode<EFiber> NODE;
+
+	static const int SAMPLE_PICKS = 32; // picks between two depth samples
+
+	struct Class {
+		NODE* head;
+		NODE* tail;
+		int count; // also of PRIORITY_DEADLINE, which only queues in dues
+	};
+
+	struct Due {
+		llong deadline; // millis
+		llong sequence; // the order of adds for equal deadlines
+		sp<EFiber>* fiber;
+	};
+
+	Class classes[EFiber::PRIORITY_CLASSES];
+	int credits[EFiber::PRIORITY_CLASSES]; // runs left in the round of PRIORITY_WEIGHTED
+	llong starvedAt[EFiber::PRIORITY_CLASSES]; // the last run ahead of a higher class
+	int picks;
+	int depth; // sampled by the last pick, else -1
+
+	// min heap of PRIORITY_DEADLINE
+	Due* dues;
+	int dueCount;
+	int dueCapacity;
+	llong sequence;
+
+	// PRIORITY_FAIR_SHARE
+	Class groups[EFiber::MAX_GROUPS];
+	int* groupWeights;
+	volatile llong* groupVtimes; // shared by all threads
+	llong vclock; // the vtime of the last picked group
+
+	EFiberScheduler::PriorityPolicy policy;
+	int* weights;
+	llong starvationMicros;
+	llong expiryMargin; // millis, -1 if not to cancel expired fibers
+	volatile int* queued; // depths for other threads
+	EFiberScheduler::Stats* stats;
+
+	PriorityRuns(EFiberScheduler::PriorityPolicy p, int* w, llong starvationMillis,
+			llong em, int* gw, volatile llong* gv, volatile int* q,
+			EFiberScheduler::Stats* s) :
+			picks(0), depth(-1), dues(null), dueCount(0), dueCapacity(0),
+			sequence(0), groupWeights(gw), groupVtimes(gv), vclock(0),
+			policy(p), weights(w),
+			starvationMicros(starvationMillis * 1000), expiryMargin(em),
+			queued(q), stats(s) {
+		for (int c = 0; c < EFiber::PRIORITY_CLASSES; c++) {
+			classes[c].head = classes[c].tail = null;
+			classes[c].count = 0;
+			credits[c] = weights[c];
+			starvedAt[c] = 0;
+			queued[c] = 0;
+		}
+		for (int g = 0; g < EFiber::MAX_GROUPS; g++) {
+			groups[g].head = groups[g].tail = null;
+			groups[g].count = 0;
+		}
+	}
+
+	~PriorityRuns() {
+		free(dues);
+	}
+
+	sp<EFiber>* poll(EFiberMpscQueue<EFiber>* queue) {
+		llong now = ESystem::nanoTime() / 1000;
+		llong nowMillis = (policy == EFiberScheduler::PRIORITY_DEADLINE) ? ESystem::currentTimeMillis() : 0;
+
+		// bounded, a flood of adds can't hold the thread here.
+		sp<EFiber>* fibers[32];
+		for (int round = 0, n; round < 8 && (n = queue->drain(fibers, 32)) > 0; round++) {
+			for (int i = 0; i < n; i++) {
+				add(fibers[i], now, nowMillis);
+			}
+		}
+
+		depth = -1;
+		if (picks++ % SAMPLE_PICKS == 0) {
+			depth = 0;
+			for (int c = 0; c < EFiber::PRIORITY_CLASSES; c++) {
+				depth += classes[c].count;
+			}
+		}
+
+		sp<EFiber>* fiber_;
+		if (policy == EFiberScheduler::PRIORITY_DEADLINE) {
+			fiber_ = (dueCount > 0) ? removeDue(nowMillis) : null;
+		} else if (policy == EFiberScheduler::PRIORITY_FAIR_SHARE) {
+			int g = pickGroup();
+			fiber_ = (g >= 0) ? removeGroup(g) : null;
+		} else {
+			int c = pick(now);
+			fiber_ = (c >= 0) ? remove(c) : null;
+		}
+		if (!fiber_) {
+			picks = 0; // sample again on the next fiber
+			return null;
+		}
+
+		EFiber* fiber = (*fiber_).get();
+		int c = fiber->readyClass;
+		llong wait = now - fiber->readySince;
+		stats->priorityRuns[c]++;
+		stats->priorityWaitMicros[c] += wait;
+		if (wait > stats->priorityMaxWaitMicros[c]) {
+			stats->priorityMaxWaitMicros[c] = wait;
+		}
+		return fiber_;
+	}
+
+	int pick(llong now) {
+		int c = -1;
+		if (policy == EFiberScheduler::PRIORITY_STRICT) {
+			for (int i = 0; i < EFiber::PRIORITY_CLASSES && c < 0; i++) {
+				if (classes[i].count > 0) {
+					c = i;
+				}
+			}
+		} else {
+			for (int round = 0; round < 2 && c < 0; round++) {
+				for (int i = 0; i < EFiber::PRIORITY_CLASSES && c < 0; i++) {
+					if (classes[i].count > 0 && credits[i] > 0) {
+						c = i;
+					}
+				}
+				if (c < 0) {
+					// a new round.
+					for (int i = 0; i < EFiber::PRIORITY_CLASSES; i++) {
+						credits[i] = weights[i];
+					}
+				}
+			}
+		}
+		if (c < 0) {
+			return -1;
+		}
+
+		// the lowest starving class goes first, it takes no credit. Once a
+		// starvation limit at most, a deep backlog can't starve the others.
+		for (int i = EFiber::PRIORITY_CLASSES - 1; i > c; i--) {
+			if (classes[i].count > 0 && now - starvedAt[i] >= starvationMicros
+					&& now - (*classes[i].head->value)->readySince >= starvationMicros) {
+				starvedAt[i] = now;
+				stats->starvedRuns++;
+				return i;
+			}
+		}
+		credits[c]--;
+		return c;
+	}
+
+	/**
+	 * The queued group with the least vtime, its fibers in order.
+	 */
+	int pickGroup() {
+		int g = -1;
+		llong min = 0;
+		for (int i = 0; i < EFiber::MAX_GROUPS; i++) {
+			if (groups[i].count > 0) {
+				llong v = __atomic_load_n(&groupVtimes[i], __ATOMIC_RELAXED);
+				if (g < 0 || v < min) {
+					g = i;
+					min = v;
+				}
+			}
+		}
+		if (g >= 0) {
+			vclock = min;
+		}
+		return g;
+	}
+
+	/**
+	 * Charge the run time of a fiber to its group.
+	 */
+	void charge(EFiber* fiber, llong nanos) {
+		int g = fiber->group;
+		// scaled, a heavy weight still moves the vtime of short runs.
+		__atomic_fetch_add(&groupVtimes[g], nanos * 64 / groupWeights[g], __ATOMIC_RELAXED);
+		stats->groupRuns[g]++;
+		stats->groupRunNanos[g] += nanos;
+	}
+
+	static int classOf(EFiber* fiber) {
+		int c = fiber->priority;
+		return (c < 0 || c >= EFiber::PRIORITY_CLASSES) ? EFiber::PRIORITY_NORMAL : c;
+	}
+
+	void add(sp<EFiber>* fiber_, llong now, llong nowMillis) {
+		EFiber* fiber = (*fiber_).get();
+		int c = classOf(fiber);
+		fiber->readySince = now;
+		fiber->readyClass = c;
+		__atomic_store_n(&queued[c], ++classes[c].count, __ATOMIC_RELAXED);
+
+		if (policy == EFiberScheduler::PRIORITY_DEADLINE) {
+			llong deadline = fiber->deadline;
+			if (deadline <= 0) {
+				deadline = nowMillis + starvationMicros / 1000;
+			}
+			addDue(deadline, fiber_);
+			return;
+		}
+
+		if (policy == EFiberScheduler::PRIORITY_FAIR_SHARE) {
+			int g = fiber->group;
+			if (groups[g].count++ == 0) {
+				// an idle group starts from now, the share it missed is gone.
+				llong v = __atomic_load_n(&groupVtimes[g], __ATOMIC_RELAXED);
+				while (v < vclock && !__atomic_compare_exchange_n(&groupVtimes[g],
+						&v, vclock, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				}
+			}
+			append(&groups[g], fiber_);
+			return;
+		}
+
+		append(&classes[c], fiber_);
+	}
+
+	static void append(Class* q, sp<EFiber>* fiber_) {
+		// the node is free since the fiber left the task queue.
+		NODE* node = (*fiber_)->packing;
+		node->value = fiber_;
+		node->next = null;
+		if (q->tail) {
+			q->tail->next = node;
+		} else {
+			q->head = node;
+		}
+		q->tail = node;
+	}
+
+	static sp<EFiber>* unlink(Class* q) {
+		NODE* node = q->head;
+		q->head = node->next;
+		if (!q->head) {
+			q->tail = null;
+		}
+		return node->value;
+	}
+
+	sp<EFiber>* remove(int c) {
+		sp<EFiber>* fiber_ = unlink(&classes[c]);
+		__atomic_store_n(&queued[c], --classes[c].count, __ATOMIC_RELAXED);
+		return fiber_;
+	}
+
+	sp<EFiber>* removeGroup(int g) {
+		sp<EFiber>* fiber_ = unlink(&groups[g]);
+		groups[g].count--;
+		int c = (*fiber_)->readyClass; // not of setPriority() since the add.
+		__atomic_store_n(&queued[c], --classes[c].count, __ATOMIC_RELAXED);
+		return fiber_;
+	}
+
+	static boolean before(const Due& a, const Due& b) {
+		return (a.deadline < b.deadline || (a.deadline == b.deadline && a.sequence < b.sequence));
+	}
+
+	void addDue(llong deadline, sp<EFiber>* fiber_) {
+		if (dueCount == dueCapacity) {
+			int capacity = ES_MAX(dueCapacity * 2, 64);
+			Due* p = (Due*)realloc(dues, capacity * sizeof(Due));
+			if (!p) {
+				throw ERuntimeException(__FILE__, __LINE__, "realloc");
+			}
+			dues = p;
+			dueCapacity = capacity;
+		}
+		Due due = {deadline, sequence++, fiber_};
+		int i = dueCount++;
+		while (i > 0) {
+			int parent = (i - 1) / 2;
+			if (!before(due, dues[parent])) {
+				break;
+			}
+			dues[i] = dues[parent];
+			i = parent;
+		}
+		dues[i] = due;
+	}
+
+	sp<EFiber>* removeDue(llong nowMillis) {
+		Due top = dues[0];
+		Due last = dues[--dueCount];
+		int i = 0;
+		for (;;) {
+			int child = i * 2 + 1;
+			if (child >= dueCount) {
+				break;
+			}
+			if (child + 1 < dueCount && before(dues[child + 1], dues[child])) {
+				child++;
+			}
+			if (!before(dues[child], last)) {
+				break;
+			}
+			dues[i] = dues[child];
+			i = child;
+		}
+		if (dueCount > 0) {
+			dues[i] = last;
+		}
+
+		EFiber* fiber = (*top.fiber).get();
+		int c = fiber->readyClass; // not of setPriority() since the add.
+		__atomic_store_n(&queued[c], --classes[c].count, __ATOMIC_RELAXED);
+
+		if (expiryMargin >= 0 && fiber->deadline > 0
+				&& fiber->deadline - expiryMargin < nowMillis
+				&& !fiber->context && !fiber->canceled) {
+			// (almost) late before its first run.
+			fiber->canceled = true;
+			fiber->expired = true;
+			stats->deadlinesCanceled++;
+		}
+		return top.fiber;
+	}
+
+	/**
+	 * Called before a fiber first runs on this thread.
+	 */
+	void firstRun(EFiber* fiber) {
+		if (policy == EFiberScheduler::PRIORITY_DEADLINE && fiber->deadline > 0
+				&& fiber->deadline < ESystem::currentTimeMillis()) {
+			stats->deadlinesMissed++;
+		}
+	}
+
+	boolean isEmpty() {
+		for (int c = 0; c < EFiber::PRIORITY_CLASSES; c++) {
+			if (classes[c].count > 0) {
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+/**
+ * Fibers drained from a run queue in one go and run one by one, after
+ * the fiber of the run next slot.
+ */
+struct RunBatch {
+	static const int SIZE = 32;
+
+	sp<EFiber>* fibers[SIZE];
+	int index;
+	int count;
+	PriorityRuns* priorities; // null with PRIORITY_FIFO
+
+	sp<EFiber>* next; // the run next slot
+	int nextRuns; // fibers from the slot in a row
+	int nextMaxRuns;
+	boolean fromNext; // the last poll() took the slot
+	EFiberScheduler::Stats* stats;
+
+	RunBatch(PriorityRuns* pr, int maxRuns, EFiberScheduler::Stats* s):
+			index(0), count(0), priorities(pr), next(null), nextRuns(0),
+			nextMaxRuns(maxRuns), fromNext(false), stats(s) {}
+
+	sp<EFiber>* poll(EFiberMpscQueue<EFiber>* queue) {
+		if (next) {
+			sp<EFiber>* fiber_ = next;
+			next = null;
+			if (nextRuns++ < nextMaxRuns) {
+				fromNext = true;
+				stats->runNextRuns++;
+				return fiber_;
+			}
+			queue->add(fiber_); // its turn is over.
+		}
+		nextRuns = 0;
+		fromNext = false;
+
+		if (priorities) {
+			return priorities->poll(queue);
+		}
+		if (index == count) {
+			index = 0;
+			count = queue->drain(fibers, SIZE);
+			if (count == 0) {
+				return null;
+			}
+		}
+		return fibers[index++];
+	}
+
+	/**
+	 * The fiber of the slot if it may run next.
+	 */
+	sp<EFiber>* peekNext() {
+		return (nextRuns < nextMaxRuns) ? next : null;
+	}
+
+	/**
+	 * Take the fiber of the slot to switch to it from a running one.
+	 */
+	void takeNext() {
+		next = null;
+		nextRuns++;
+		stats->runNextRuns++;
+		stats->directSwitches++;
+	}
+
+	/**
+	 * Put a fiber woken on this thread to the slot.
+	 */
+	void putNext(sp<EFiber>* fiber_, EFiberMpscQueue<EFiber>* queue) {
+		if (next) {
+			queue->add(next);
+		}
+		next = fiber_;
+	}
+
+	boolean isEmpty(EFiberMpscQueue<EFiber>* queue) {
+		if (next) {
+			return false;
+		}
+		if (priorities) {
+			return (priorities->isEmpty() && queue->isEmpty());
+		}
+		return (index == count && queue->isEmpty());
+	}
+
+	/**
+	 * The count drained by the last poll() if it refilled, else -1, or
+	 * the queued count sampled each SAMPLE_PICKS picks by priorities.
+	 */
+	int refilled() {
+		if (fromNext) {
+			return -1;
+		}
+		if (priorities) {
+			return priorities->depth;
+		}
+		return (index == 1) ? count : -1;
+	}
 };
 
 class IoWaiterFiber: public EFiber {
@@ -100,9 +674,86 @@ private:
 
 //=============================================================================
 
+EFiberScheduler::Stats::Stats() :
+		hibernatedFibers(0),
+		hibernatedBytes(0),
+		trimmedFibers(0),
+		trimmedPages(0),
+		stolenFibers(0),
+		ioPolls(0),
+		ioPollSkips(0),
+		idleSpinWakeups(0),
+		idleYieldWakeups(0),
+		idleParks(0),
+		wakeupsIssued(0),
+		wakeupsSuppressed(0),
+		threadsGrown(0),
+		threadsRetired(0),
+		starvedRuns(0),
+		deadlinesMissed(0),
+		deadlinesCanceled(0),
+		runNextRuns(0),
+		directSwitches(0) {
+	for (int i = 0; i < EFiber::PRIORITY_CLASSES; i++) {
+		priorityRuns[i] = 0;
+		priorityWaitMicros[i] = 0;
+		priorityMaxWaitMicros[i] = 0;
+	}
+	for (int i = 0; i < EFiber::MAX_GROUPS; i++) {
+		groupRuns[i] = 0;
+		groupRunNanos[i] = 0;
+	}
+}
+
+void EFiberScheduler::Stats::add(const Stats& other) {
+	hibernatedFibers += other.hibernatedFibers;
+	hibernatedBytes += other.hibernatedBytes;
+	trimmedFibers += other.trimmedFibers;
+	trimmedPages += other.trimmedPages;
+	stolenFibers += other.stolenFibers;
+	ioPolls += other.ioPolls;
+	ioPollSkips += other.ioPollSkips;
+	idleSpinWakeups += other.idleSpinWakeups;
+	idleYieldWakeups += other.idleYieldWakeups;
+	idleParks += other.idleParks;
+	wakeupsIssued += other.wakeupsIssued;
+	wakeupsSuppressed += other.wakeupsSuppressed;
+	threadsGrown += other.threadsGrown;
+	threadsRetired += other.threadsRetired;
+	for (int i = 0; i < EFiber::PRIORITY_CLASSES; i++) {
+		priorityRuns[i] += other.priorityRuns[i];
+		priorityWaitMicros[i] += other.priorityWaitMicros[i];
+		priorityMaxWaitMicros[i] = ES_MAX(priorityMaxWaitMicros[i], other.priorityMaxWaitMicros[i]);
+	}
+	starvedRuns += other.starvedRuns;
+	deadlinesMissed += other.deadlinesMissed;
+	deadlinesCanceled += other.deadlinesCanceled;
+	runNextRuns += other.runNextRuns;
+	directSwitches += other.directSwitches;
+	for (int i = 0; i < EFiber::MAX_GROUPS; i++) {
+		groupRuns[i] += other.groupRuns[i];
+		groupRunNanos[i] += other.groupRunNanos[i];
+	}
+}
+
+llong EFiberScheduler::ThreadLoad::score() const {
+	// the queued ones are counted again as they run before a new one.
+	return (llong)(fibers + queued) * (1000 + busyPermille);
+}
+
+//=============================================================================
+
 EFiberScheduler::~EFiberScheduler() {
+	if (workers) {
+		interrupt();
+		try {
+			stop();
+		} catch (...) {
+		}
+	}
 	delete schedulerStubs;
 	delete hookedFiles;
+	delete stackProfiler;
 }
 
 EFiberScheduler::EFiberScheduler() :
@@ -110,10 +761,51 @@ EFiberScheduler::EFiberScheduler() :
 		threadNums(1),
 		schedulerStubs(null),
 		balanceCallback(null),
+		loadBalanceCallback(null),
+		balancePolicy(BALANCE_ROUND_ROBIN),
+		loadAware(false),
+		priorityPolicy(PRIORITY_FIFO),
+		starvationMillis(100),
+		cancelExpired(false),
+		dropCanceled(false),
+		expiryMarginMillis(0),
 		scheduleCallback(null),
 		hookedFiles(new EFileContextManager(maxEventSetSize)),
+		stackPoolMaxStacks(EFiberStackPool::DEFAULT_MAX_STACKS_PER_CLASS),
+		stackPoolMaxBytes(EFiberStackPool::DEFAULT_MAX_CACHED_BYTES),
+		prewarmCount(0),
+		prewarmStackSize(0),
+		sharedStackCount(0),
+		sharedStackSize(0),
+		hibernateMillis(0),
+		trimMillis(0),
+		trimMinRss(0),
+		stackProfiler(null),
+		workStealing(false),
+		runNextOn(true),
+		runNextMaxRuns(8),
+		ioPollPolicy(IO_POLL_EACH_RUN),
+		ioPollRuns(64),
+		ioPollMicros(200),
+		idleSpinMicros(0),
+		idleYieldMicros(0),
+		threadAffinity(AFFINITY_NONE),
+		workers(null),
+		stopping(false),
+		stubsReady(false),
+		elasticMinThreads(0),
+		growQueueDepth(8),
+		growMicros(2000),
+		shrinkMillis(5000),
+		growing(false),
+		workerCpus(null),
 		interrupted(false) {
-	//
+	setPriorityWeights();
+	memset((void*)defaultPriorityQueued, 0, sizeof(defaultPriorityQueued));
+	for (int i = 0; i < EFiber::MAX_GROUPS; i++) {
+		groupWeights[i] = 1;
+		groupVtimes[i] = 0;
+	}
 }
 
 EFiberScheduler::EFiberScheduler(int maxfd) :
@@ -121,10 +813,51 @@ EFiberScheduler::EFiberScheduler(int maxfd) :
 		threadNums(1),
 		schedulerStubs(null),
 		balanceCallback(null),
+		loadBalanceCallback(null),
+		balancePolicy(BALANCE_ROUND_ROBIN),
+		loadAware(false),
+		priorityPolicy(PRIORITY_FIFO),
+		starvationMillis(100),
+		cancelExpired(false),
+		dropCanceled(false),
+		expiryMarginMillis(0),
 		scheduleCallback(null),
 		hookedFiles(new EFileContextManager(maxEventSetSize)),
+		stackPoolMaxStacks(EFiberStackPool::DEFAULT_MAX_STACKS_PER_CLASS),
+		stackPoolMaxBytes(EFiberStackPool::DEFAULT_MAX_CACHED_BYTES),
+		prewarmCount(0),
+		prewarmStackSize(0),
+		sharedStackCount(0),
+		sharedStackSize(0),
+		hibernateMillis(0),
+		trimMillis(0),
+		trimMinRss(0),
+		stackProfiler(null),
+		workStealing(false),
+		runNextOn(true),
+		runNextMaxRuns(8),
+		ioPollPolicy(IO_POLL_EACH_RUN),
+		ioPollRuns(64),
+		ioPollMicros(200),
+		idleSpinMicros(0),
+		idleYieldMicros(0),
+		threadAffinity(AFFINITY_NONE),
+		workers(null),
+		stopping(false),
+		stubsReady(false),
+		elasticMinThreads(0),
+		growQueueDepth(8),
+		growMicros(2000),
+		shrinkMillis(5000),
+		growing(false),
+		workerCpus(null),
 		interrupted(false) {
-	//
+	setPriorityWeights();
+	memset((void*)defaultPriorityQueued, 0, sizeof(defaultPriorityQueued));
+	for (int i = 0; i < EFiber::MAX_GROUPS; i++) {
+		groupWeights[i] = 1;
+		groupVtimes[i] = 0;
+	}
 }
 
 void EFiberScheduler::scheduleIgnoreBalance(sp<EFiber> fiber, boolean ignoreBalance) {
@@ -133,29 +866,157 @@ void EFiberScheduler::scheduleIgnoreBalance(sp<EFiber> fiber, boolean ignoreBala
 	fiber->state = EFiber::RUNNABLE;
 	fiber->setScheduler(this);
 
-	if (!schedulerStubs) {
-		defaultTaskQueue.add(new sp<EFiber>(fiber));
-	} else {
-		int index = 0;
-		if (ignoreBalance) {
-			EFiber* activeFiber = EFiberScheduler::activeFiber();
-			if (activeFiber) {
-				index = activeFiber->threadIndex;
-			}
+	if (!ignoreBalance && !fiber->keyed) {
+		// children of a keyed fiber stay with its key.
+		EFiber* activeFiber = EFiberScheduler::activeFiber();
+		if (activeFiber && activeFiber->keyed && activeFiber->scheduler == this) {
+			fiber->keyed = true;
+			fiber->key = activeFiber->key;
+		}
+	}
+	if (fiber->keyed) {
+		fiber->pinned = true;
+	}
+
+	// publishStubs() and retireStubs() wait the threads reading the stubs,
+	// a fiber added to defaultTaskQueue meanwhile is dispatched after. A
+	// stopping pool takes no more fibers, they wait the next start().
+	schedulingThreads++;
+	EA<SchedulerStub*>* stubs = __atomic_load_n(&stopping, __ATOMIC_SEQ_CST) ? null
+			: __atomic_load_n(&schedulerStubs, __ATOMIC_SEQ_CST);
+	try {
+		if (!stubs) {
+			defaultTaskQueue.add(new sp<EFiber>(fiber));
 		} else {
-			if (balanceCallback) {
-				index = balanceCallback(fiber.get(), threadNums);
+			int index = 0;
+			if (ignoreBalance) {
+				EFiber* activeFiber = EFiberScheduler::activeFiber();
+				if (activeFiber) {
+					index = activeFiber->threadIndex;
+				}
+				fiber->pinned = true;
 			} else {
-				index = (balanceIndex++) % schedulerStubs->length();
+				index = balance(fiber.get());
+			}
+			sp<EFiber>* fiber_ = new sp<EFiber>(fiber);
+			while (!pushTo(stubs->getAt(index), fiber_)) {
+				// retired just now.
+				index = balance(fiber.get());
 			}
 		}
-		SchedulerStub* ss = schedulerStubs->getAt(index);
-		ss->taskQueue.add(new sp<EFiber>(fiber));
-		EIoWaiter* iw = ss->hungIoWaiter;
-		if (iw) {
-			iw->signal();
+	} catch (...) {
+		schedulingThreads--;
+		throw;
+	}
+	schedulingThreads--;
+}
+
+/**
+ * Jump consistent hash (Lamping and Veach), only 1/n of the keys move
+ * when the count of buckets changes to n.
+ */
+static int jumpHash(es_uint64_t key, int buckets) {
+	llong b = -1;
+	llong j = 0;
+	while (j < buckets) {
+		b = j;
+		key = key * 2862933555777941757ULL + 1;
+		j = (llong)((b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1)));
+	}
+	return (int)b;
+}
+
+int EFiberScheduler::keyedThreads() {
+	return (elasticMinThreads > 0) ? elasticMinThreads : threadNums;
+}
+
+int EFiberScheduler::threadIndexOfKey(llong key) {
+	return jumpHash((es_uint64_t)key, keyedThreads());
+}
+
+int EFiberScheduler::balance(EFiber* fiber) {
+	if (fiber->keyed) {
+		return jumpHash((es_uint64_t)fiber->key, keyedThreads());
+	}
+
+	int n = threadNums;
+	int index;
+	if (loadBalanceCallback) {
+		index = loadBalanceCallback(fiber, n, this);
+	} else if (balanceCallback) {
+		index = balanceCallback(fiber, n);
+	} else if (balancePolicy == BALANCE_LEAST_LOADED) {
+		index = leastLoaded(n);
+	} else if (balancePolicy == BALANCE_TWO_CHOICES) {
+		index = twoChoices(n);
+	} else {
+		index = (balanceIndex++) % n;
+	}
+	if (index < 0 || index >= n) {
+		index = (index % n + n) % n;
+	}
+	return index;
+}
+
+int EFiberScheduler::leastLoaded(int n) {
+	// scan from a rolling start so that ties go round robin.
+	int from = (balanceIndex++) % n;
+	int best = from;
+	llong bestScore = -1;
+	ThreadLoad load;
+	for (int i = 0; i < n; i++) {
+		int index = (from + i) % n;
+		if (!getThreadLoad(index, &load)) {
+			continue;
 		}
+		llong score = load.score();
+		if (bestScore < 0 || score < bestScore) {
+			best = index;
+			bestScore = score;
+			if (score == 0) {
+				break;
+			}
+		}
+	}
+	return best;
+}
+
+int EFiberScheduler::twoChoices(int n) {
+	if (n == 1) {
+		return 0;
+	}
+	// two distinct threads picked by a scrambled counter.
+	unsigned int r = (unsigned int)(balanceIndex++) * 0x9E3779B9u;
+	int a = (r >> 16) % n;
+	int b = (a + 1 + (r & 0xFFFF) % (n - 1)) % n;
+	ThreadLoad la, lb;
+	if (!getThreadLoad(a, &la)) {
+		return b;
+	}
+	if (!getThreadLoad(b, &lb)) {
+		return a;
 	}
+	return (lb.score() < la.score()) ? b : a;
+}
+
+boolean EFiberScheduler::pushTo(SchedulerStub* stub, sp<EFiber>* fiber) {
+	if (elasticMinThreads > 0) {
+		// the retiring thread waits no pusher before its last drain.
+		stub->pushers++;
+		if (__atomic_load_n(&stub->retired, __ATOMIC_SEQ_CST)) {
+			stub->pushers--;
+			return false;
+		}
+		stub->taskQueue.add(fiber);
+		stub->pushers--;
+	} else {
+		stub->taskQueue.add(fiber);
+	}
+	EIoWaiter* iw = stub->hungIoWaiter;
+	if (iw) {
+		iw->signal();
+	}
+	return true;
 }
 
 void EFiberScheduler::schedule(sp<EFiber> fiber) {
@@ -166,6 +1027,17 @@ void EFiberScheduler::scheduleInheritThread(sp<EFiber> fiber) {
 	scheduleIgnoreBalance(fiber, true);
 }
 
+void EFiberScheduler::schedule(sp<EFiber> fiber, EDate* deadline) {
+	fiber->deadline = deadline ? deadline->getTime() : 0;
+	scheduleIgnoreBalance(fiber, false);
+}
+
+void EFiberScheduler::scheduleWithKey(llong key, sp<EFiber> fiber) {
+	fiber->keyed = true;
+	fiber->key = key;
+	scheduleIgnoreBalance(fiber, false);
+}
+
 #ifdef CPP11_SUPPORT
 sp<EFiber> EFiberScheduler::schedule(std::function<void()> f, int stackSize) {
 	class Fiber: public EFiber {
@@ -201,6 +1073,40 @@ sp<EFiber> EFiberScheduler::scheduleInheritThread(std::function<void()> f, int s
 	this->scheduleIgnoreBalance(fiber, true); //!
 	return fiber;
 }
+sp<EFiber> EFiberScheduler::schedule(std::function<void()> f, EDate* deadline, int stackSize) {
+	class Fiber: public EFiber {
+	public:
+		Fiber(std::function<void()> f, int stackSize):
+			EFiber(stackSize), func(f) {
+		}
+		virtual void run() {
+			func();
+		}
+	private:
+		std::function<void()> func;
+	};
+
+	sp<EFiber> fiber(new Fiber(f, stackSize));
+	this->schedule(fiber, deadline); //!
+	return fiber;
+}
+sp<EFiber> EFiberScheduler::scheduleWithKey(llong key, std::function<void()> f, int stackSize) {
+	class Fiber: public EFiber {
+	public:
+		Fiber(std::function<void()> f, int stackSize):
+			EFiber(stackSize), func(f) {
+		}
+		virtual void run() {
+			func();
+		}
+	private:
+		std::function<void()> func;
+	};
+
+	sp<EFiber> fiber(new Fiber(f, stackSize));
+	this->scheduleWithKey(key, fiber); //!
+	return fiber;
+}
 #endif
 
 sp<EFiberTimer> EFiberScheduler::addtimer(sp<EFiberTimer> timer, llong delay) {
@@ -238,50 +1144,451 @@ sp<EFiberTimer> EFiberScheduler::addtimer(sp<EFiberTimer> timer, EDate* firstTim
 		tf->init();
 		this->schedule(tf);
 	}
-	return timer;
+	return timer;
+}
+
+#ifdef CPP11_SUPPORT
+void EFiberScheduler::addtimer(std::function<void()> f, llong delay) {
+	this->addtimer(new Timer(f), delay);
+}
+
+void EFiberScheduler::addtimer(std::function<void()> f, EDate* time) {
+	this->addtimer(new Timer(f), time);
+}
+
+void EFiberScheduler::addtimer(std::function<void()> f, llong delay, llong period) {
+	this->addtimer(new Timer(f), delay, period);
+}
+
+void EFiberScheduler::addtimer(std::function<void()> f, EDate* firstTime, llong period) {
+	this->addtimer(new Timer(f), firstTime, period);
+}
+#endif
+
+#ifdef CPP11_SUPPORT
+void EFiberScheduler::setScheduleCallback(std::function<void(int threadIndex,
+		SchedulePhase schedulePhase, EThread* currentThread,
+		EFiber* currentFiber)> callback) {
+	this->scheduleCallback = callback;
+}
+#else
+void EFiberScheduler::setScheduleCallback(thread_schedule_callback_t* callback) {
+	this->scheduleCallback = callback;
+}
+#endif
+
+#ifdef CPP11_SUPPORT
+void EFiberScheduler::setBalanceCallback(std::function<int(EFiber* fiber, int threadNums)> balancer) {
+	this->balanceCallback = balancer;
+}
+#else
+void EFiberScheduler::setBalanceCallback(fiber_schedule_balance_t* balancer) {
+	this->balanceCallback = balancer;
+}
+#endif
+
+#ifdef CPP11_SUPPORT
+void EFiberScheduler::setLoadBalanceCallback(std::function<int(EFiber* fiber, int threadNums, EFiberScheduler* scheduler)> balancer) {
+	this->loadBalanceCallback = balancer;
+	this->loadAware = (balancer || balancePolicy != BALANCE_ROUND_ROBIN);
+}
+#else
+void EFiberScheduler::setLoadBalanceCallback(fiber_load_balance_t* balancer) {
+	this->loadBalanceCallback = balancer;
+	this->loadAware = (balancer || balancePolicy != BALANCE_ROUND_ROBIN);
+}
+#endif
+
+void EFiberScheduler::setPriorityPolicy(PriorityPolicy policy, llong starvationMillis) {
+	this->priorityPolicy = policy;
+	this->starvationMillis = ES_MAX(starvationMillis, 1);
+}
+
+void EFiberScheduler::setCancelExpired(boolean on, llong marginMillis) {
+	this->cancelExpired = on;
+	this->expiryMarginMillis = ES_MAX(marginMillis, 0);
+}
+
+void EFiberScheduler::setDropCanceled(boolean on) {
+	this->dropCanceled = on;
+}
+
+void EFiberScheduler::setPriorityWeights(int urgent, int normal, int background) {
+	priorityWeights[EFiber::PRIORITY_URGENT] = ES_MAX(urgent, 1);
+	priorityWeights[EFiber::PRIORITY_NORMAL] = ES_MAX(normal, 1);
+	priorityWeights[EFiber::PRIORITY_BACKGROUND] = ES_MAX(background, 1);
+}
+
+void EFiberScheduler::setGroupWeight(int group, int weight) {
+	if (group < 0 || group >= EFiber::MAX_GROUPS) {
+		throw EIllegalArgumentException(__FILE__, __LINE__, "group out of range");
+	}
+	groupWeights[group] = ES_MAX(weight, 1);
+}
+
+void EFiberScheduler::setBalancePolicy(BalancePolicy policy) {
+	this->balancePolicy = policy;
+	this->loadAware = (loadBalanceCallback || policy != BALANCE_ROUND_ROBIN);
+}
+
+boolean EFiberScheduler::getThreadLoad(int threadIndex, ThreadLoad* load) {
+	// read once, a balancer of schedule() may see them retired meanwhile.
+	EA<SchedulerStub*>* stubs = __atomic_load_n(&schedulerStubs, __ATOMIC_ACQUIRE);
+	if (!stubs) {
+		// join() without threads.
+		if (threadIndex != 0) {
+			return false;
+		}
+		load->fibers = totalFiberCounter.value();
+		load->queued = defaultTaskQueue.size();
+		for (int c = 0; c < EFiber::PRIORITY_CLASSES; c++) {
+			load->queuedByPriority[c] = defaultPriorityQueued[c];
+			load->queued += load->queuedByPriority[c];
+		}
+		load->waiters = 0;
+		load->busyPermille = 0;
+		return true;
+	}
+	if (threadIndex < 0 || threadIndex >= threadNums || threadIndex >= stubs->length()) {
+		return false;
+	}
+	SchedulerStub* stub = stubs->getAt(threadIndex);
+	if (!stub) {
+		return false;
+	}
+	load->fibers = stub->boundFibers.value();
+	load->queued = stub->taskQueue.size();
+	for (int c = 0; c < EFiber::PRIORITY_CLASSES; c++) {
+		load->queuedByPriority[c] = stub->priorityQueued[c];
+		load->queued += load->queuedByPriority[c];
+	}
+	load->waiters = stub->ioWaiter.getWaitersCount();
+	load->busyPermille = stub->busyPermille;
+	return true;
+}
+
+void EFiberScheduler::sampleBusy(SchedulerLocal* local, SchedulerStub* stub, llong idleFrom) {
+	llong now = ESystem::nanoTime() / 1000;
+	if (idleFrom > 0) {
+		local->idleMicros += now - idleFrom;
+	}
+	if (local->busySince == 0) {
+		local->busySince = now;
+		local->idleMicros = 0;
+		return;
+	}
+	llong elapsed = now - local->busySince;
+	if (elapsed < 10000) {
+		return;
+	}
+	int busy = (int)(1000 - ES_MIN(local->idleMicros, elapsed) * 1000 / elapsed);
+	stub->busyPermille = (stub->busyPermille * 3 + busy) / 4;
+	local->busySince = now;
+	local->idleMicros = 0;
+}
+
+void EFiberScheduler::setStackPoolCapacity(int maxStacksPerClass, llong maxCachedBytes) {
+	this->stackPoolMaxStacks = maxStacksPerClass;
+	this->stackPoolMaxBytes = maxCachedBytes;
+}
+
+void EFiberScheduler::prewarm(int n, int stackSize) {
+	this->prewarmCount = n;
+	this->prewarmStackSize = stackSize;
+}
+
+void EFiberScheduler::setSharedStack(int count, int stackSize) {
+	this->sharedStackCount = count;
+	this->sharedStackSize = stackSize;
+}
+
+void EFiberScheduler::setStackHibernation(llong idleMillis) {
+	this->hibernateMillis = idleMillis;
+}
+
+void EFiberScheduler::setStackTrimming(llong intervalMillis, llong minRssBytes) {
+	this->trimMillis = intervalMillis;
+	this->trimMinRss = minRssBytes;
+}
+
+void EFiberScheduler::setStackAutoSizing(int sampleRate, int marginPercent) {
+	if (stackProfiler) {
+		stackProfiler->setSampling(sampleRate, marginPercent);
+	} else {
+		stackProfiler = new EFiberStackProfiler(sampleRate, marginPercent);
+	}
+}
+
+EString EFiberScheduler::exportStackProfile() {
+	return stackProfiler ? stackProfiler->exportProfile() : EString();
+}
+
+void EFiberScheduler::importStackProfile(const char* profile) {
+	if (!stackProfiler) {
+		// apply the imported sizes only, with the default margin.
+		stackProfiler = new EFiberStackProfiler(0, 50);
+	}
+	stackProfiler->importProfile(profile);
+}
+
+void EFiberScheduler::setWorkStealing(boolean on) {
+	this->workStealing = on;
+}
+
+void EFiberScheduler::setRunNext(boolean on, int maxRuns) {
+	this->runNextOn = on;
+	this->runNextMaxRuns = ES_MAX(maxRuns, 1);
+}
+
+void EFiberScheduler::setIoPollPolicy(IoPollPolicy policy, int maxRuns, llong maxMicros) {
+	this->ioPollPolicy = policy;
+	this->ioPollRuns = ES_MAX(maxRuns, 1);
+	this->ioPollMicros = maxMicros;
+}
+
+void EFiberScheduler::setIdlePolicy(llong spinMicros, llong yieldMicros) {
+	this->idleSpinMicros = spinMicros;
+	this->idleYieldMicros = yieldMicros;
+}
+
+void EFiberScheduler::setThreadAffinity(ThreadAffinity affinity, const char* cpuList) {
+	ECpuSet cpus;
+	if (cpuList && (!cpus.parse(cpuList) || cpus.isEmpty())) {
+		throw EIllegalArgumentException(__FILE__, __LINE__, "cpuList");
+	}
+	this->threadAffinity = affinity;
+	this->threadCpuList = cpuList ? cpuList : "";
+}
+
+EFiberScheduler::Stats EFiberScheduler::getStats(int threadIndex) {
+	if (schedulerStubs && threadIndex >= 0 && threadIndex < schedulerStubs->length()) {
+		SchedulerStub* stub = schedulerStubs->getAt(threadIndex);
+		if (!stub) {
+			return Stats(); // never added
+		}
+		Stats stats = stub->stats;
+		stats.wakeupsIssued = stub->ioWaiter.getSignalsIssued();
+		stats.wakeupsSuppressed = stub->ioWaiter.getSignalsSuppressed();
+		return stats;
+	}
+	return (threadIndex == 0) ? defaultStats : Stats();
+}
+
+EFiberScheduler::Stats EFiberScheduler::getStats() {
+	Stats stats;
+	stats.add(defaultStats);
+	if (schedulerStubs) {
+		for (int i=0; i<schedulerStubs->length(); i++) {
+			stats.add(getStats(i));
+		}
+	}
+	return stats;
+}
+
+int EFiberScheduler::availableProcessors() {
+	return ECpuSet::availableProcessors();
+}
+
+boolean EFiberScheduler::placeThread(int index, ECpuSet* allowed) {
+	ECpuSet cpus;
+	switch (threadAffinity) {
+	case AFFINITY_CPU:
+		cpus.add(allowed->get(index % allowed->count()));
+		break;
+	case AFFINITY_NUMA_NODE:
+	{
+		// thread i on the i-th node which has allowed cpus.
+		int nodes = ECpuSet::numaNodes();
+		int usable = 0;
+		for (int node = 0; node < nodes; node++) {
+			ECpuSet c = ECpuSet::ofNumaNode(node);
+			c.retain(*allowed);
+			if (!c.isEmpty()) usable++;
+		}
+		if (usable == 0) {
+			cpus = *allowed; // no numa info
+			break;
+		}
+		int n = index % usable;
+		for (int node = 0; node < nodes; node++) {
+			ECpuSet c = ECpuSet::ofNumaNode(node);
+			c.retain(*allowed);
+			if (!c.isEmpty() && n-- == 0) {
+				cpus = c;
+				break;
+			}
+		}
+	}
+		break;
+	case AFFINITY_CPUSET:
+		cpus = *allowed;
+		break;
+	default:
+		return false;
+	}
+	boolean bound = cpus.bindCurrentThread();
+	ECO_DEBUG(EFiberDebugger::SCHEDULER, "thread#%d bound to %d cpus: %d", index, cpus.count(), bound);
+	return bound;
+}
+
+boolean EFiberScheduler::isMovable(EFiber* fiber) {
+	if (fiber->pinned) {
+		return false;
+	}
+	// a woken fiber still has to delete its event from this thread's io waiter.
+	return fiber->movable && !(fiber->context && fiber->context->isThreadBound());
+}
+
+boolean EFiberScheduler::handOff(sp<EFiber>* fiber_, int index) {
+	SchedulerStub* stub = schedulerStubs->getAt(index);
+	EFiber* fiber = (*fiber_).get();
+	int n = threadNums;
+	for (int i = 1; i < n; i++) {
+		SchedulerStub* ss = schedulerStubs->getAt((index + i) % n);
+		if (ss->hungIoWaiter || ss->spinning) {
+			// once for each run, not to bounce among sleeping threads.
+			EFiberMpscQueue<EFiber>* boundQueue = fiber->boundQueue;
+			fiber->movable = false;
+			fiber->boundQueue = &ss->taskQueue;
+			ss->boundFibers++;
+			if (!pushTo(ss, fiber_)) {
+				ss->boundFibers--;
+				fiber->boundQueue = boundQueue;
+				fiber->movable = true;
+				continue;
+			}
+			if (boundQueue == &stub->taskQueue) {
+				stub->boundFibers--;
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+boolean EFiberScheduler::isIoPollDue(SchedulerLocal* local, Stats* stats) {
+	if (ioPollPolicy == IO_POLL_EACH_RUN) {
+		return true;
+	}
+	int budget = (ioPollPolicy == IO_POLL_BUDGET) ? ioPollRuns : local->pollBudget;
+	if (++local->pollRuns >= budget) {
+		return true;
+	}
+	if (ioPollMicros > 0 && ESystem::nanoTime() - local->lastPollTime >= ioPollMicros * 1000) {
+		return true;
+	}
+	stats->ioPollSkips++;
+	return false;
+}
+
+void EFiberScheduler::ioPolled(SchedulerLocal* local, int events, Stats* stats) {
+	stats->ioPolls++;
+	local->pollRuns = 0;
+	if (ioPollMicros > 0) {
+		local->lastPollTime = ESystem::nanoTime();
+	}
+	if (ioPollPolicy == IO_POLL_ADAPTIVE) {
+		// poll about as often as the polls wake fibers.
+		if (events <= local->pollBudget) {
+			local->pollBudget = ES_MIN(local->pollBudget << 1, ioPollRuns);
+		} else if (events > (local->pollBudget << 1)) {
+			local->pollBudget = ES_MAX(local->pollBudget >> 1, 1);
+		}
+	}
+}
+
+boolean EFiberScheduler::spinForWork(SchedulerStub* stub) {
+	llong now = ESystem::nanoTime();
+	llong spinEnd = now + idleSpinMicros * 1000;
+	llong yieldEnd = spinEnd + idleYieldMicros * 1000;
+	boolean found = false;
+
+	stub->spinning = true;
+	idleThreads++;
+	while (now < yieldEnd) {
+		if (!stub->taskQueue.isEmpty()) {
+			found = true;
+			break;
+		}
+		if (interrupted || totalFiberCounter.value() == 0) {
+			break;
+		}
+		if (now < spinEnd) {
+			for (int i = 0; i < 64; i++) {
+				cpuRelax();
+			}
+		} else {
+			EThread::yield();
+		}
+		now = ESystem::nanoTime();
+	}
+	idleThreads--;
+	stub->spinning = false;
+
+	if (found) {
+		if (now < spinEnd) {
+			stub->stats.idleSpinWakeups++;
+		} else {
+			stub->stats.idleYieldWakeups++;
+		}
+	}
+	return found;
 }
 
-#ifdef CPP11_SUPPORT
-void EFiberScheduler::addtimer(std::function<void()> f, llong delay) {
-	this->addtimer(new Timer(f), delay);
-}
+void EFiberScheduler::maintainStacks(EIoWaiter* ioWaiter, SchedulerLocal* local, Stats* stats) {
+	llong now = ESystem::currentTimeMillis();
+	int count;
 
-void EFiberScheduler::addtimer(std::function<void()> f, EDate* time) {
-	this->addtimer(new Timer(f), time);
-}
+	if (hibernateMillis > 0 && now >= local->nextHibernateTime) {
+		llong bytes = ioWaiter->hibernate(hibernateMillis, &count);
+		stats->hibernatedFibers += count;
+		stats->hibernatedBytes += bytes;
+		local->nextHibernateTime = now + ES_MAX(hibernateMillis / 2, 10);
+		ECO_DEBUG(EFiberDebugger::SCHEDULER, "hibernated %d fibers: %lld bytes", count, bytes);
+	}
 
-void EFiberScheduler::addtimer(std::function<void()> f, llong delay, llong period) {
-	this->addtimer(new Timer(f), delay, period);
+	if (trimMillis > 0 && now >= local->nextTrimTime) {
+		if (trimMinRss <= 0 || residentSetSize() >= trimMinRss) {
+			llong bytes = ioWaiter->trim(&count);
+			stats->trimmedFibers += count;
+			stats->trimmedPages += bytes / EFiberStack::pageSize();
+			ECO_DEBUG(EFiberDebugger::SCHEDULER, "trimmed %d fibers: %lld bytes", count, bytes);
+		}
+		local->nextTrimTime = now + trimMillis;
+	}
 }
 
-void EFiberScheduler::addtimer(std::function<void()> f, EDate* firstTime, llong period) {
-	this->addtimer(new Timer(f), firstTime, period);
-}
-#endif
+void EFiberScheduler::newContext(EFiber* fiber) {
+	fiber->context = new EContext(fiber);
 
-#ifdef CPP11_SUPPORT
-void EFiberScheduler::setScheduleCallback(std::function<void(int threadIndex,
-		SchedulePhase schedulePhase, EThread* currentThread,
-		EFiber* currentFiber)> callback) {
-	this->scheduleCallback = callback;
-}
-#else
-void EFiberScheduler::setScheduleCallback(thread_schedule_callback_t* callback) {
-	this->scheduleCallback = callback;
+	if (stackProfiler && !fiber->name.isEmpty()) {
+		int size = fiber->stackSize;
+		boolean sample = stackProfiler->prepare(fiber->name.c_str(), &size);
+		fiber->stackSize = ES_MAX(size, EFiber::MIN_STACK_SIZE);
+		fiber->context->setStackSampling(sample);
+	}
 }
-#endif
 
-#ifdef CPP11_SUPPORT
-void EFiberScheduler::setBalanceCallback(std::function<int(EFiber* fiber, int threadNums)> balancer) {
-	this->balanceCallback = balancer;
-}
-#else
-void EFiberScheduler::setBalanceCallback(fiber_schedule_balance_t* balancer) {
-	this->balanceCallback = balancer;
+void EFiberScheduler::profileStack(EFiber* fiber) {
+	int used = fiber->context ? fiber->context->getStackHighWater() : -1;
+	if (used >= 0) {
+		stackProfiler->record(fiber->name.c_str(), used);
+		ECO_DEBUG(EFiberDebugger::SCHEDULER, "fiber[%s] used stack: %d", fiber->getName(), used);
+	}
 }
-#endif
 
 void EFiberScheduler::join() {
+	if (workers) {
+		awaitDrained();
+		if (interrupted) {
+			throw EInterruptedException(__FILE__, __LINE__);
+		}
+		if (hasError.get()) {
+			throw ERuntimeException(__FILE__, __LINE__, "join fail");
+		}
+		return;
+	}
+
 	EThread* currentThread = EThread::currentThread();
 #ifdef CPP11_SUPPORT
 	std::function<void(int threadIndex,
@@ -294,10 +1601,30 @@ void EFiberScheduler::join() {
 	long currentThreadID = currentThread->getId();
 	EIoWaiter ioWaiter(maxEventSetSize);
 	SchedulerLocal schedulerLocal(this);
+	PriorityRuns priorityRuns(priorityPolicy, priorityWeights, starvationMillis,
+			cancelExpired ? expiryMarginMillis : -1, groupWeights, groupVtimes,
+			defaultPriorityQueued, &defaultStats);
+	boolean fairShare = (priorityPolicy == PRIORITY_FAIR_SHARE); // charge run time to groups
+	RunBatch runBatch((priorityPolicy != PRIORITY_FIFO) ? &priorityRuns : null,
+			runNextMaxRuns, &defaultStats);
+	if (runNextOn && priorityPolicy == PRIORITY_FIFO) {
+		schedulerLocal.runBatch = &runBatch;
+		schedulerLocal.runQueue = &defaultTaskQueue;
+	}
 
 	currScheduler.set(&schedulerLocal);
 	currIoWaiter.set(&ioWaiter);
 
+	EContext::installStackGuard();
+
+	EFiberStackPool* stackPool = EFiberStackPool::attach(stackPoolMaxStacks, stackPoolMaxBytes);
+	if (prewarmCount > 0) {
+		stackPool->prewarm(prewarmCount, prewarmStackSize);
+	}
+	if (sharedStackCount > 0) {
+		stackPool->setSharedStacks(sharedStackCount, sharedStackSize);
+	}
+
 	if (scheduleCallback) {
 		scheduleCallback(0, SCHEDULE_BEFORE, currentThread, NULL);
 	}
@@ -309,9 +1636,13 @@ void EFiberScheduler::join() {
 
 		int total = totalFiberCounter.value();
 
-		sp<EFiber>* fiber_ = defaultTaskQueue.poll();
+		sp<EFiber>* fiber_ = runBatch.poll(&defaultTaskQueue);
 		if (!fiber_) {
 			if (total > 0) {
+				if (hibernateMillis > 0 || trimMillis > 0) {
+					maintainStacks(&ioWaiter, &schedulerLocal, &defaultStats);
+				}
+
 				/**
 				 * inactive fibers is BLOCKED or WAITING!
 				 */
@@ -328,10 +1659,31 @@ void EFiberScheduler::join() {
 		}
 		EFiber* fiber = (*fiber_).get();
 
-		if (ioWaiter.getWaitersCount() > 0) {
+		if (!fiber->context) {
+			if (fiber->expired || (fiber->canceled && dropCanceled)) {
+				// canceled before the first run, nothing to allocate.
+				fiber->state = EFiber::TERMINATED;
+				delete fiber_;
+				totalFiberCounter--;
+				continue;
+			}
+			if (runBatch.priorities) {
+				runBatch.priorities->firstRun(fiber);
+			}
+			// materialized on the first run, the stack is bound in swapIn().
+			newContext(fiber);
+		}
+
+		if (ioWaiter.getWaitersCount() > 0 && isIoPollDue(&schedulerLocal, &defaultStats)) {
 			// io waiter process.
 			int events = ioWaiter.onceProcessEvents();
 			ECO_DEBUG(EFiberDebugger::SCHEDULER, "return the number of events: %d", events);
+			ioPolled(&schedulerLocal, events, &defaultStats);
+
+			if ((hibernateMillis > 0 || trimMillis > 0)
+					&& (++schedulerLocal.maintainTicks & 1023) == 0) {
+				maintainStacks(&ioWaiter, &schedulerLocal, &defaultStats);
+			}
 		}
 
 		if (!fiber->boundQueue) {
@@ -350,7 +1702,16 @@ void EFiberScheduler::join() {
 		if (scheduleCallback) {
 			scheduleCallback(0, FIBER_BEFORE, currentThread, fiber);
 		}
+		llong runFrom = fairShare ? ESystem::nanoTime() : 0;
 		fiber->context->swapIn();
+		if (schedulerLocal.currFiber != fiber) {
+			// switched to another one by EFiber::yieldTo().
+			fiber = schedulerLocal.currFiber;
+			fiber_ = fiber->packing->value;
+		}
+		if (runFrom > 0) {
+			priorityRuns.charge(fiber, ESystem::nanoTime() - runFrom);
+		}
 		if (scheduleCallback) {
 			scheduleCallback(0, FIBER_AFTER, currentThread, fiber);
 		}
@@ -375,6 +1736,9 @@ void EFiberScheduler::join() {
 		}
 			break;
 		case EFiber::TERMINATED:
+			if (stackProfiler) {
+				profileStack(fiber);
+			}
 			delete fiber_;
 			totalFiberCounter--;
 			break;
@@ -388,9 +1752,14 @@ CLEAN:
 	currIoWaiter.set(null);
 	currScheduler.set(null);
 
+	defaultStats.wakeupsIssued += ioWaiter.getSignalsIssued();
+	defaultStats.wakeupsSuppressed += ioWaiter.getSignalsSuppressed();
+
 	// do some clean.
 	clearFileContexts();
 	EContext::cleanOrignContext();
+	EContext::uninstallStackGuard();
+	EFiberStackPool::detach();
 
 	if (scheduleCallback) {
 		scheduleCallback(0, SCHEDULE_AFTER, currentThread, NULL);
@@ -403,8 +1772,15 @@ CLEAN:
 
 void EFiberScheduler::join(int threadNums) {
 
-	if (threadNums < 1) {
-		throw EIllegalArgumentException(__FILE__, __LINE__, "threadNums < 1");
+	if (workers) {
+		join(); //!
+		return;
+	}
+	if (threadNums < 0) {
+		throw EIllegalArgumentException(__FILE__, __LINE__, "threadNums < 0");
+	}
+	if (threadNums == 0) {
+		threadNums = availableProcessors();
 	}
 	if (threadNums == 1) {
 		join(); //!
@@ -413,66 +1789,64 @@ void EFiberScheduler::join(int threadNums) {
 	// if (threadNums == 1) then ignore balanceCallback.
 	this->threadNums = threadNums;
 
-	// create thread local scheduler stub
-	schedulerStubs = new EA<SchedulerStub*>(threadNums);
-	for (int i=0; i<threadNums; i++) {
-		schedulerStubs->setAt(i, new SchedulerStub(maxEventSetSize));
-	}
+	// cpus to place threads on.
+	ECpuSet origin;
+	ECpuSet allowed;
+	placeableCpus(&origin, &allowed);
 
 	// reset error.
 	hasError.set(false);
 
-	// multi-threading.
-	class Worker: public EThread {
-	public:
-		EFiberScheduler* scheduler;
-		int index;
-	public:
-		virtual void run() {
-			try {
-				scheduler->joinWithThreadBind(scheduler->schedulerStubs, index, this);
-			} catch (...) {
-				scheduler->hasError.set(true);
-			}
-		}
-	};
-
 	/**
 	 * Don't forget current thread self to work together.
 	 */
 
 	// create other threads.
-	EA<sp<Worker> > pool(threadNums - 1);
-	for (int i=0; i<threadNums-1; i++) {
-		Worker* worker = new Worker();
-		worker->scheduler = this;
-		worker->index = i + 1; // 0 is for current thread.
-		pool[i] = worker;
+	retireStubs();
+	EA<SchedulerStub*>* stubs = new EA<SchedulerStub*>(threadNums);
+	EA<SchedulerWorker*>* pool = startWorkers(stubs, 1, threadNums - 1, &allowed); // 0 is for current thread.
+
+	// create thread local scheduler stub
+	boolean pinned = placeThread(0, &allowed);
+	try {
+		stubs->setAt(0, new SchedulerStub(maxEventSetSize));
+	} catch (...) {
+		hasError.set(true);
 	}
 
-	// dispatch fibers to each thread.
-	sp<EFiber>* fiber_;
-	while ((fiber_ = defaultTaskQueue.poll()) != null) {
-		int i = 0;
-		if (balanceCallback) {
-			i = balanceCallback((*fiber_).get(), threadNums);
-		} else {
-			i = (balanceIndex++) % threadNums;
+	if (!publishStubs(stubs, pool->length())) {
+		for (int i=0; i<pool->length(); i++) {
+			pool->getAt(i)->join();
 		}
-		schedulerStubs->getAt(i)->taskQueue.add(fiber_);
+		delete pool;
+		delete stubs;
+		if (pinned) {
+			origin.bindCurrentThread();
+		}
+		throw ERuntimeException(__FILE__, __LINE__, "join fail");
 	}
 
-	// worker run.
-	for (int i=0; i<pool.length(); i++) {
-		pool[i]->start();
-	}
+	// dispatch fibers to each thread.
+	dispatchTasks();
 
 	// current thread work.
-	joinWithThreadBind(schedulerStubs, 0, EThread::currentThread());
+	try {
+		joinWithThreadBind(schedulerStubs, 0, EThread::currentThread());
+	} catch (...) {
+		if (pinned) {
+			origin.bindCurrentThread();
+		}
+		throw;
+	}
 
 	// wait other threads work finished.
-	for (int i=0; i<pool.length(); i++) {
-		pool[i]->join();
+	for (int i=0; i<pool->length(); i++) {
+		pool->getAt(i)->join();
+	}
+	delete pool;
+
+	if (pinned) {
+		origin.bindCurrentThread();
 	}
 
 	// do some clean.
@@ -483,18 +1857,319 @@ void EFiberScheduler::join(int threadNums) {
 	}
 }
 
+void EFiberScheduler::start(int threadNums) {
+	if (threadNums < 0) {
+		throw EIllegalArgumentException(__FILE__, __LINE__, "threadNums < 0");
+	}
+	if (threadNums == 0) {
+		threadNums = availableProcessors();
+	}
+	start(threadNums, threadNums);
+}
+
+void EFiberScheduler::start(int minThreads, int maxThreads) {
+	if (workers) {
+		throw EIllegalStateException(__FILE__, __LINE__, "already started");
+	}
+	if (minThreads < 1 || maxThreads < minThreads) {
+		throw EIllegalArgumentException(__FILE__, __LINE__, "minThreads < 1 || maxThreads < minThreads");
+	}
+	this->threadNums = minThreads;
+	this->elasticMinThreads = (maxThreads > minThreads) ? minThreads : 0;
+
+	ECpuSet origin;
+	workerCpus = new ECpuSet();
+	placeableCpus(&origin, workerCpus);
+
+	hasError.set(false);
+	stopping = false;
+	growing = false;
+
+	retireStubs();
+	EA<SchedulerStub*>* stubs = new EA<SchedulerStub*>(maxThreads);
+	workers = startWorkers(stubs, 0, minThreads, workerCpus);
+
+	if (!publishStubs(stubs, minThreads)) {
+		for (int i=0; i<minThreads; i++) {
+			workers->getAt(i)->join();
+		}
+		delete workers;
+		workers = null;
+		delete stubs;
+		delete workerCpus;
+		workerCpus = null;
+		elasticMinThreads = 0;
+		throw ERuntimeException(__FILE__, __LINE__, "start fail");
+	}
+
+	// fibers scheduled before.
+	dispatchTasks();
+}
+
+void EFiberScheduler::setElasticPolicy(int growQueueDepth, llong growMicros, llong shrinkMillis) {
+	this->growQueueDepth = ES_MAX(1, ES_MIN(growQueueDepth, RunBatch::SIZE));
+	this->growMicros = growMicros;
+	this->shrinkMillis = shrinkMillis;
+}
+
+int EFiberScheduler::getThreadCount() {
+	return threadNums;
+}
+
+void EFiberScheduler::checkGrowth(SchedulerLocal* local, int depth, Stats* stats) {
+	if (depth < growQueueDepth) {
+		local->backlogSince = 0;
+		return;
+	}
+	llong now = ESystem::nanoTime() / 1000;
+	if (local->backlogSince == 0) {
+		local->backlogSince = now;
+		return;
+	}
+	if (now - local->backlogSince < growMicros || idleThreads.value() > 0 || stopping) {
+		return;
+	}
+	local->backlogSince = 0;
+
+	// one at a time, the new thread clears it when it's running.
+	if (!__sync_bool_compare_and_swap(&growing, false, true)) {
+		return;
+	}
+	int index = threadNums;
+	if (index >= schedulerStubs->length() || stopping) {
+		growing = false;
+		return;
+	}
+	SchedulerWorker* retired = workers->getAt(index);
+	if (retired) {
+		retired->join(); // exited already
+		delete retired;
+	}
+	SchedulerWorker* worker = new SchedulerWorker(this, schedulerStubs, index, workerCpus);
+	workers->setAt(index, worker);
+	worker->start();
+	stats->threadsGrown++;
+	ECO_DEBUG(EFiberDebugger::SCHEDULER, "thread#%d added, run queue depth %d", index, depth);
+}
+
+void EFiberScheduler::threadAdded(int index) {
+	SchedulerStub* stub = schedulerStubs->getAt(index);
+	if (stub) {
+		__atomic_store_n(&stub->retired, false, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&threadNums, index + 1, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&growing, false, __ATOMIC_RELEASE);
+}
+
+boolean EFiberScheduler::retireThread(SchedulerStub* stub, int index) {
+	if (stopping || index != threadNums - 1 || index < elasticMinThreads
+			|| stub->boundFibers.value() > 0 || stub->ioWaiter.getWaitersCount() > 0
+			|| !stub->taskQueue.isEmpty()) {
+		return false;
+	}
+	// not while a thread is being added.
+	if (!__sync_bool_compare_and_swap(&growing, false, true)) {
+		return false;
+	}
+	if (stopping || index != threadNums - 1) {
+		__atomic_store_n(&growing, false, __ATOMIC_RELEASE);
+		return false;
+	}
+	threadNums = index;
+	__atomic_store_n(&growing, false, __ATOMIC_RELEASE);
+
+	// no more fibers to it once no one is adding.
+	__atomic_store_n(&stub->retired, true, __ATOMIC_SEQ_CST);
+	while (stub->pushers.value() > 0) {
+		EThread::yield();
+	}
+
+	// hand fibers added meanwhile to the others, only movable ones were
+	// bound to it by a hand-off.
+	sp<EFiber>* fiber_;
+	while ((fiber_ = stub->taskQueue.poll()) != null) {
+		EFiber* fiber = (*fiber_).get();
+		if (fiber->boundQueue == &stub->taskQueue) {
+			fiber->boundQueue = null;
+			stub->boundFibers--;
+		}
+		while (!pushTo(schedulerStubs->getAt(balance(fiber)), fiber_)) {
+		}
+	}
+
+	stub->stats.threadsRetired++;
+	ECO_DEBUG(EFiberDebugger::SCHEDULER, "thread#%d retired", index);
+	return true;
+}
+
+void EFiberScheduler::stop() {
+	if (!workers) {
+		return;
+	}
+
+	awaitDrained();
+
+	__atomic_store_n(&stopping, true, __ATOMIC_SEQ_CST);
+	// no thread is being added then.
+	while (!__sync_bool_compare_and_swap(&growing, false, true)) {
+		EThread::yield();
+	}
+	for (int i=0; i<schedulerStubs->length(); i++) {
+		SchedulerStub* ss = schedulerStubs->getAt(i);
+		if (ss) {
+			ss->ioWaiter.signal();
+		}
+	}
+	for (int i=0; i<workers->length(); i++) {
+		SchedulerWorker* worker = workers->getAt(i);
+		if (worker) {
+			worker->join();
+		}
+	}
+	delete workers;
+	workers = null;
+	delete workerCpus;
+	workerCpus = null;
+	growing = false;
+
+	retireStubs();
+	this->threadNums = 1;
+	this->elasticMinThreads = 0;
+	stopping = false; // the stubs are gone, fibers go to defaultTaskQueue.
+
+	// do some clean.
+	clearFileContexts();
+
+	if (hasError.get()) {
+		throw ERuntimeException(__FILE__, __LINE__, "stop fail");
+	}
+}
+
+boolean EFiberScheduler::isStarted() {
+	return workers != null;
+}
+
+void EFiberScheduler::placeableCpus(ECpuSet* origin, ECpuSet* allowed) {
+	*origin = ECpuSet::ofCurrentThread();
+	*allowed = *origin;
+	if (!threadCpuList.isEmpty()) {
+		ECpuSet listed;
+		listed.parse(threadCpuList.c_str());
+		allowed->retain(listed);
+	}
+	if (allowed->isEmpty()) {
+		*allowed = *origin;
+	}
+}
+
+EA<SchedulerWorker*>* EFiberScheduler::startWorkers(EA<SchedulerStub*>* stubs,
+		int from, int count, ECpuSet* allowed) {
+	placedThreads.set(0);
+	stubsReady = false;
+
+	EA<SchedulerWorker*>* pool = new EA<SchedulerWorker*>(stubs->length() - from);
+	for (int i=0; i<count; i++) {
+		SchedulerWorker* worker = new SchedulerWorker(this, stubs, i + from, allowed);
+		pool->setAt(i, worker);
+		worker->start();
+	}
+	return pool;
+}
+
+boolean EFiberScheduler::publishStubs(EA<SchedulerStub*>* stubs, int workerCount) {
+	while (placedThreads.get() < workerCount) {
+		EThread::yield();
+	}
+	if (!hasError.get()) {
+		__atomic_store_n(&schedulerStubs, stubs, __ATOMIC_SEQ_CST);
+		// dispatchTasks() then sees the fibers of those which read null.
+		awaitScheduling();
+	}
+	__atomic_store_n(&stubsReady, true, __ATOMIC_RELEASE);
+	return !hasError.get();
+}
+
+void EFiberScheduler::dispatchTasks() {
+	sp<EFiber>* fiber_;
+	while ((fiber_ = defaultTaskQueue.poll()) != null) {
+		while (!pushTo(schedulerStubs->getAt(balance((*fiber_).get())), fiber_)) {
+		}
+	}
+}
+
+void EFiberScheduler::retireStubs() {
+	if (!schedulerStubs) {
+		return;
+	}
+	// keep the statistics of the threads.
+	for (int i=0; i<schedulerStubs->length(); i++) {
+		defaultStats.add(getStats(i));
+	}
+	EA<SchedulerStub*>* stubs = schedulerStubs;
+	__atomic_store_n(&schedulerStubs, (EA<SchedulerStub*>*)null, __ATOMIC_SEQ_CST);
+	awaitScheduling();
+
+	// fibers added after their thread exited wait the next start() or join().
+	for (int i=0; i<stubs->length(); i++) {
+		SchedulerStub* ss = stubs->getAt(i);
+		sp<EFiber>* fiber_;
+		while (ss && (fiber_ = ss->taskQueue.poll()) != null) {
+			EFiber* fiber = (*fiber_).get();
+			if (fiber->boundQueue == &ss->taskQueue) {
+				fiber->boundQueue = null;
+			}
+			defaultTaskQueue.add(fiber_);
+		}
+	}
+	delete stubs;
+}
+
+void EFiberScheduler::awaitScheduling() {
+	while (schedulingThreads.value() > 0) {
+		EThread::yield();
+	}
+}
+
+void EFiberScheduler::awaitDrained() {
+	SYNCHRONIZED(&drainSync) {
+		while (totalFiberCounter.value() > 0 && !interrupted && !hasError.get()) {
+			drainSync.wait(100);
+		}
+	}}
+}
+
 void EFiberScheduler::joinWithThreadBind(EA<SchedulerStub*>* schedulerStubs,
 		int index, EThread* currentThread) {
 	SchedulerStub* stub = schedulerStubs->getAt(index);
 	EIoWaiter* ioWaiter = &stub->ioWaiter;
-	EFiberConcurrentQueue<EFiber>* localQueue = &stub->taskQueue;
+	EFiberMpscQueue<EFiber>* localQueue = &stub->taskQueue;
 
 	long currentThreadID = currentThread->getId();
 	SchedulerLocal schedulerLocal(this);
+	PriorityRuns priorityRuns(priorityPolicy, priorityWeights, starvationMillis,
+			cancelExpired ? expiryMarginMillis : -1, groupWeights, groupVtimes,
+			stub->priorityQueued, &stub->stats);
+	boolean fairShare = (priorityPolicy == PRIORITY_FAIR_SHARE); // charge run time to groups
+	RunBatch runBatch((priorityPolicy != PRIORITY_FIFO) ? &priorityRuns : null,
+			runNextMaxRuns, &stub->stats);
+	if (runNextOn && priorityPolicy == PRIORITY_FIFO) {
+		schedulerLocal.runBatch = &runBatch;
+		schedulerLocal.runQueue = localQueue;
+	}
 
 	currScheduler.set(&schedulerLocal);
 	currIoWaiter.set(ioWaiter);
 
+	EContext::installStackGuard();
+
+	EFiberStackPool* stackPool = EFiberStackPool::attach(stackPoolMaxStacks, stackPoolMaxBytes);
+	if (prewarmCount > 0) {
+		stackPool->prewarm(prewarmCount, prewarmStackSize);
+	}
+	if (sharedStackCount > 0) {
+		stackPool->setSharedStacks(sharedStackCount, sharedStackSize);
+	}
+
 	if (scheduleCallback) {
 		scheduleCallback(index, SCHEDULE_BEFORE, currentThread, NULL);
 	}
@@ -507,16 +2182,63 @@ void EFiberScheduler::joinWithThreadBind(EA<SchedulerStub*>* schedulerStubs,
 		int total = totalFiberCounter.value();
 
 		// try get from thread local queue.
-		sp<EFiber>* fiber_ = localQueue->poll();
+		sp<EFiber>* fiber_ = runBatch.poll(localQueue);
 		if (!fiber_) {
-			if (total > 0) {
+			if (total == 0 && workers && !stopping) {
+				// all done, threads of start() wait for new fibers.
+				SYNCHRONIZED(&drainSync) {
+					drainSync.notifyAll();
+				}}
+			}
+			if (workers && __atomic_load_n(&stopping, __ATOMIC_SEQ_CST)) {
+				// counted after stopping, a fiber scheduled since is either
+				// seen here or waits the next start() in defaultTaskQueue.
+				total = totalFiberCounter.value() - defaultTaskQueue.size();
+			}
+			if (total > 0 || (workers && !stopping)) {
+				int parkMillis = 3000;
+				if (elasticMinThreads > 0) {
+					llong now = ESystem::currentTimeMillis();
+					if (schedulerLocal.idleSince == 0) {
+						schedulerLocal.idleSince = now;
+					} else if (now - schedulerLocal.idleSince >= shrinkMillis
+							&& retireThread(stub, index)) {
+						goto CLEAN;
+					}
+					parkMillis = ES_MIN(parkMillis, ES_MAX(shrinkMillis, 1));
+				}
+
+				if (hibernateMillis > 0 || trimMillis > 0) {
+					maintainStacks(ioWaiter, &schedulerLocal, &stub->stats);
+				}
+
+				llong idleFrom = loadAware ? ESystem::nanoTime() / 1000 : 0;
+
+				if ((idleSpinMicros > 0 || idleYieldMicros > 0) && spinForWork(stub)) {
+					if (loadAware) {
+						sampleBusy(&schedulerLocal, stub, idleFrom);
+					}
+					continue;
+				}
+
 				/**
 				 * inactive fibers is BLOCKED or WAITING!
 				 */
 				stub->hungIoWaiter = ioWaiter;
-				int events = ioWaiter->onceProcessEvents(3000);
+				idleThreads++;
+				__sync_synchronize();
+				if (localQueue->isEmpty()) {
+					// not to miss a fiber added before it was seen hung.
+					int events = ioWaiter->onceProcessEvents(parkMillis);
+					stub->stats.idleParks++;
+				}
+				idleThreads--;
 				stub->hungIoWaiter = null;
 
+				if (loadAware) {
+					sampleBusy(&schedulerLocal, stub, idleFrom);
+				}
+
 				if (scheduleCallback) {
 					scheduleCallback(index, SCHEDULE_IDLE, currentThread, NULL);
 				}
@@ -528,16 +2250,61 @@ void EFiberScheduler::joinWithThreadBind(EA<SchedulerStub*>* schedulerStubs,
 		}
 		EFiber* fiber = (*fiber_).get();
 
-		if (ioWaiter->getWaitersCount() > 0) {
+		if (elasticMinThreads > 0) {
+			schedulerLocal.idleSince = 0;
+			int depth = runBatch.refilled();
+			if (depth >= 0 && threadNums < schedulerStubs->length()) {
+				checkGrowth(&schedulerLocal, depth, &stub->stats);
+			}
+		}
+
+		if (loadAware && runBatch.refilled() >= 0) {
+			sampleBusy(&schedulerLocal, stub, 0);
+		}
+
+		// an added thread takes its share of the backlog the same way.
+		if ((workStealing || elasticMinThreads > 0) && idleThreads.value() > 0
+				&& !runBatch.isEmpty(localQueue)
+				&& isMovable(fiber) && handOff(fiber_, index)) {
+			stub->stats.stolenFibers++;
+			continue;
+		}
+
+		if (!fiber->context) {
+			if (fiber->expired || (fiber->canceled && dropCanceled)) {
+				// canceled before the first run, nothing to allocate.
+				fiber->state = EFiber::TERMINATED;
+				if (fiber->boundQueue == localQueue) {
+					stub->boundFibers--;
+				}
+				delete fiber_;
+				totalFiberCounter--;
+				continue;
+			}
+			if (runBatch.priorities) {
+				runBatch.priorities->firstRun(fiber);
+			}
+			// materialized on the first run, the stack is bound in swapIn().
+			newContext(fiber);
+		}
+
+		if (ioWaiter->getWaitersCount() > 0 && isIoPollDue(&schedulerLocal, &stub->stats)) {
 			// io waiter process.
 			int events = ioWaiter->onceProcessEvents();
 			ECO_DEBUG(EFiberDebugger::SCHEDULER, "return the number of events: %d", events);
+			ioPolled(&schedulerLocal, events, &stub->stats);
+
+			if ((hibernateMillis > 0 || trimMillis > 0)
+					&& (++schedulerLocal.maintainTicks & 1023) == 0) {
+				maintainStacks(ioWaiter, &schedulerLocal, &stub->stats);
+			}
 		}
 
 		fiber->setThreadIndex(index);
 
 		if (!fiber->boundQueue) {
 			fiber->boundQueue = localQueue;
+			stub->boundFibers++;
 		}
 		fiber->boundThreadID = currentThreadID;
 
@@ -552,7 +2319,17 @@ void EFiberScheduler::joinWithThreadBind(EA<SchedulerStub*>* schedulerStubs,
 		if (scheduleCallback) {
 			scheduleCallback(index, FIBER_BEFORE, currentThread, fiber);
 		}
+		llong runFrom = fairShare ? ESystem::nanoTime() : 0;
+		fiber->movable = false;
 		fiber->context->swapIn();
+		if (schedulerLocal.currFiber != fiber) {
+			// switched to another one by EFiber::yieldTo().
+			fiber = schedulerLocal.currFiber;
+			fiber_ = fiber->packing->value;
+		}
+		if (runFrom > 0) {
+			priorityRuns.charge(fiber, ESystem::nanoTime() - runFrom);
+		}
 		if (scheduleCallback) {
 			scheduleCallback(index, FIBER_AFTER, currentThread, fiber);
 		}
@@ -566,6 +2343,7 @@ void EFiberScheduler::joinWithThreadBind(EA<SchedulerStub*>* schedulerStubs,
 		switch (fiber->state) {
 		case EFiber::RUNNABLE:
 		{
+			fiber->movable = true;
 			// add to thread local queue.
 			localQueue->add(fiber_);
 		}
@@ -580,6 +2358,12 @@ void EFiberScheduler::joinWithThreadBind(EA<SchedulerStub*>* schedulerStubs,
 		}
 			break;
 		case EFiber::TERMINATED:
+			if (stackProfiler) {
+				profileStack(fiber);
+			}
+			if (fiber->boundQueue == localQueue) {
+				stub->boundFibers--;
+			}
 			delete fiber_;
 			totalFiberCounter--;
 			break;
@@ -595,12 +2379,14 @@ CLEAN:
 
 	// do some clean.
 	EContext::cleanOrignContext();
+	EContext::uninstallStackGuard();
+	EFiberStackPool::detach();
 
 	// try to notify another iowaiter in the same scheduler group.
 	for (int i=0; i<schedulerStubs->length(); i++) {
-		EIoWaiter* iw = &schedulerStubs->getAt(i)->ioWaiter;
-		if (iw != ioWaiter) {
-			iw->signal();
+		SchedulerStub* ss = schedulerStubs->getAt(i);
+		if (ss && ss != stub) {
+			ss->ioWaiter.signal();
 		}
 	}
 
@@ -617,11 +2403,13 @@ void EFiberScheduler::interrupt() {
 	interrupted = true;
 
 	//active all ioWatier.
-	if (threadNums > 1 && schedulerStubs) {
+	if (schedulerStubs) {
 		for (int i=0; i<schedulerStubs->length(); i++) {
-			EIoWaiter& iw = schedulerStubs->getAt(i)->ioWaiter;
-			iw.interrupt();
-			iw.signal();
+			SchedulerStub* ss = schedulerStubs->getAt(i);
+			if (ss) {
+				ss->ioWaiter.interrupt();
+				ss->ioWaiter.signal();
+			}
 		}
 	} else {
 		EIoWaiter* iw = currentIoWaiter();
@@ -645,6 +2433,64 @@ EFiber* EFiberScheduler::activeFiber() {
 	return sl ? sl->currFiber : null;
 }
 
+boolean EFiberScheduler::runNext(sp<EFiber>* fiber_) {
+	SchedulerLocal* sl = static_cast<SchedulerLocal*>(currScheduler.get());
+	// woken by a running fiber of the thread which the fiber is bound to.
+	if (!sl || !sl->runBatch || !sl->currFiber || (*fiber_)->boundQueue != sl->runQueue) {
+		return false;
+	}
+	sl->runBatch->putNext(fiber_, sl->runQueue);
+	return true;
+}
+
+boolean EFiberScheduler::switchNext(EFiber* fiber) {
+	SchedulerLocal* sl = static_cast<SchedulerLocal*>(currScheduler.get());
+	if (!sl || !sl->runBatch || !sl->currFiber) {
+		return false;
+	}
+	sp<EFiber>* next_ = sl->runBatch->peekNext();
+	if (!next_ || (fiber && (*next_).get() != fiber)) {
+		return false;
+	}
+	EFiber* self = sl->currFiber;
+	EFiber* next = (*next_).get();
+	if (!self->context->canSwitchTo(next->context)) {
+		return false;
+	}
+	sl->runBatch->takeNext();
+
+	EFiberScheduler* scheduler = sl->scheduler;
+	EThread* currentThread = scheduler->scheduleCallback ? EThread::currentThread() : null;
+	if (scheduler->scheduleCallback) {
+		scheduler->scheduleCallback(self->threadIndex, FIBER_AFTER, currentThread, self);
+	}
+
+	// as the loop does with a fiber swapped out, the thread is the only
+	// consumer of its queue so it can't run before the switch.
+	switch (self->state) {
+	case EFiber::RUNNABLE:
+		self->movable = true;
+		sl->runQueue->add(self->packing->value);
+		break;
+	case EFiber::BLOCKED:
+		ES_ASSERT(self->blocker);
+		if (!self->blocker->swapOut(self)) {
+			sl->runQueue->add(self->packing->value);
+		}
+		break;
+	default:
+		break; // WAITING, resumed by its io waiter.
+	}
+
+	sl->currFiber = next;
+	if (scheduler->scheduleCallback) {
+		scheduler->scheduleCallback(next->threadIndex, FIBER_BEFORE, currentThread, next);
+	}
+	next->movable = false;
+	self->context->switchTo(next->context);
+	return true;
+}
+
 EFiberScheduler* EFiberScheduler::currentScheduler() {
 	SchedulerLocal* sl = static_cast<SchedulerLocal*>(currScheduler.get());
 	return sl ? sl->scheduler : null;
@@ -0,0 +1,492 @@
+/*
+ * EFiberStack.cpp
+ *
+ *  Created on: 2026-10-16
+ *      Author: agent@local
+ */
+
+#include "./EFiberStack.hh"
+
+#include <sys/mman.h>
+
+#if !defined(MAP_ANON) && defined(MAP_ANONYMOUS)
+#define MAP_ANON MAP_ANONYMOUS
+#endif
+
+namespace efc {
+namespace eco {
+
+EFiberStack::~EFiberStack() {
+	munmap(mapAddr, mapSize);
+}
+
+EFiberStack::EFiberStack(int size): pool(null), sizeClass(-1), next(null) {
+	int page = pageSize();
+	mapSize = ES_ALIGN_UP(size, page) + page;
+
+	int flags = MAP_PRIVATE | MAP_ANON;
+#ifdef MAP_NORESERVE
+	flags |= MAP_NORESERVE; //no swap reservation, commit on touch.
+#endif
+#ifdef MAP_STACK
+	flags |= MAP_STACK;
+#endif
+	mapAddr = (char*)mmap(NULL, mapSize, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (mapAddr == MAP_FAILED) {
+		throw ERuntimeException(__FILE__, __LINE__, "mmap");
+	}
+	if (mprotect(mapAddr, page, PROT_NONE) != 0) {
+		munmap(mapAddr, mapSize);
+		throw ERuntimeException(__FILE__, __LINE__, "mprotect");
+	}
+}
+
+char* EFiberStack::bottom() {
+	return mapAddr + pageSize();
+}
+
+char* EFiberStack::top() {
+	return mapAddr + mapSize;
+}
+
+int EFiberStack::size() {
+	return mapSize - pageSize();
+}
+
+boolean EFiberStack::isGuardAddress(void* addr) {
+	char* p = (char*)addr;
+	return (p >= mapAddr && p < mapAddr + pageSize());
+}
+
+es_size_t EFiberStack::decommit(char* end) {
+	es_size_t page = pageSize();
+	char* from = bottom();
+	char* to = (char*)((es_size_t)end & ~(page - 1));
+	if (to <= from) {
+		return 0;
+	}
+	es_size_t bytes = residentBytes(from, to);
+	if (bytes == 0) {
+		return 0;
+	}
+#ifdef MADV_DONTNEED
+	if (madvise(from, to - from, MADV_DONTNEED) != 0) {
+		return 0;
+	}
+	return bytes;
+#else
+	return 0;
+#endif
+}
+
+es_size_t EFiberStack::usedBytes() {
+#ifdef __linux__
+	// the deepest resident page, faster than reading every word.
+	es_size_t page = pageSize();
+	unsigned char vec[256];
+	char* from = bottom();
+	while (from < top()) {
+		es_size_t len = ES_MIN((es_size_t)(top() - from), sizeof(vec) * page);
+		if (mincore(from, len, vec) != 0) {
+			break;
+		}
+		for (es_size_t i = 0; i < len / page; i++) {
+			if (vec[i] & 1) return top() - (from + i * page);
+		}
+		from += len;
+	}
+	if (from >= top()) {
+		return 0;
+	}
+#endif
+	// untouched pages read zero.
+	for (long* p = (long*)bottom(); (char*)p < top(); p++) {
+		if (*p) return top() - (char*)p;
+	}
+	return 0;
+}
+
+es_size_t EFiberStack::residentBytes(char* from, char* to) {
+#ifdef __linux__
+	es_size_t page = pageSize();
+	unsigned char vec[256];
+	es_size_t bytes = 0;
+	while (from < to) {
+		es_size_t len = ES_MIN((es_size_t)(to - from), sizeof(vec) * page);
+		if (mincore(from, len, vec) != 0) {
+			return to - from + bytes;
+		}
+		for (es_size_t i = 0; i < len / page; i++) {
+			if (vec[i] & 1) bytes += page;
+		}
+		from += len;
+	}
+	return bytes;
+#else
+	return to - from;
+#endif
+}
+
+int EFiberStack::pageSize() {
+	static int page = sysconf(_SC_PAGESIZE);
+	return page;
+}
+
+//=============================================================================
+
+EFiberSharedStack::EFiberSharedStack(EFiberStackPool* p, int size) :
+		stack(new EFiberStack(size)), occupant(null), pool(p) {
+}
+
+EFiberSharedStack::~EFiberSharedStack() {
+	delete stack;
+}
+
+//=============================================================================
+
+EThreadLocalStorage EFiberStackPool::threadLocal;
+
+EFiberStackPool::EFiberStackPool(int maxStacks, llong maxBytes) :
+		freeBytes(0),
+		maxStacksPerClass(maxStacks),
+		maxCachedBytes(maxBytes),
+		sharedStacks(null),
+		sharedCount(0),
+		sharedIndex(0),
+		returnList(null),
+		detached(false),
+		refs(1) {
+	for (int i = 0; i < CLASS_COUNT; i++) {
+		freeLists[i] = null;
+		freeCounts[i] = 0;
+	}
+}
+
+EFiberStackPool::~EFiberStackPool() {
+	purge();
+	for (int i = 0; i < sharedCount; i++) {
+		delete sharedStacks[i];
+	}
+	delete[] sharedStacks;
+}
+
+EFiberStackPool* EFiberStackPool::attach(int maxStacksPerClass, llong maxCachedBytes) {
+	EFiberStackPool* pool = current();
+	if (!pool) {
+		pool = new EFiberStackPool(maxStacksPerClass, maxCachedBytes);
+		threadLocal.set(pool);
+	}
+	return pool;
+}
+
+void EFiberStackPool::detach() {
+	EFiberStackPool* pool = current();
+	if (!pool) {
+		return;
+	}
+	threadLocal.set(null);
+
+	pool->returnLock.lock();
+	pool->detached = true;
+	pool->returnLock.unlock();
+
+	// stacks came back before detached.
+	pool->drainReturns();
+	pool->purge();
+	pool->unref();
+}
+
+EFiberStackPool* EFiberStackPool::current() {
+	return (EFiberStackPool*)threadLocal.get();
+}
+
+EFiberStack* EFiberStackPool::allocate(int size) {
+	EFiberStackPool* pool = current();
+	int sizeClass = sizeClassOf(size);
+	if (!pool || sizeClass < 0) {
+		return new EFiberStack(size);
+	}
+
+	EFiberStack* stack = pool->take(sizeClass);
+	if (!stack) {
+		pool->drainReturns();
+		stack = pool->take(sizeClass);
+	}
+	if (!stack) {
+		stack = new EFiberStack(1 << (sizeClass + MIN_CLASS_SHIFT));
+		stack->pool = pool;
+		stack->sizeClass = sizeClass;
+	}
+	pool->refs.incrementAndGet();
+	return stack;
+}
+
+void EFiberStackPool::release(EFiberStack* stack) {
+	EFiberStackPool* pool = stack->pool;
+	if (!pool) {
+		delete stack;
+		return;
+	}
+
+	if (pool == current()) {
+		// owner thread.
+		pool->cache(stack);
+		pool->refs.decrementAndGet();
+		return;
+	}
+
+	pool->returnLock.lock();
+	if (!pool->detached) {
+		stack->next = pool->returnList;
+		pool->returnList = stack;
+		pool->returnLock.unlock();
+		return;
+	}
+	pool->returnLock.unlock();
+
+	delete stack;
+	pool->unref();
+}
+
+void EFiberStackPool::prewarm(int n, int size) {
+	int sizeClass = sizeClassOf(size);
+	if (sizeClass < 0) {
+		return;
+	}
+	int page = EFiberStack::pageSize();
+	for (int i = 0; i < n; i++) {
+		if (freeCounts[sizeClass] >= maxStacksPerClass) {
+			break;
+		}
+		EFiberStack* stack = new EFiberStack(1 << (sizeClass + MIN_CLASS_SHIFT));
+		stack->pool = this;
+		stack->sizeClass = sizeClass;
+		for (char* p = stack->top() - page; p >= stack->bottom(); p -= page) {
+			*(volatile char*)p = 0; // pre-fault
+		}
+		cache(stack);
+	}
+}
+
+void EFiberStackPool::setSharedStacks(int count, int size) {
+	if (sharedStacks || count <= 0) {
+		return;
+	}
+	sharedStacks = new EFiberSharedStack*[count];
+	for (int i = 0; i < count; i++) {
+		sharedStacks[i] = new EFiberSharedStack(this, size);
+	}
+	sharedCount = count;
+}
+
+EFiberSharedStack* EFiberStackPool::bindShared(int size) {
+	EFiberStackPool* pool = current();
+	if (!pool || pool->sharedCount == 0) {
+		return null;
+	}
+	EFiberSharedStack* shared = pool->sharedStacks[pool->sharedIndex];
+	if (size > shared->stack->size()) {
+		return null;
+	}
+	pool->sharedIndex = (pool->sharedIndex + 1) % pool->sharedCount;
+	pool->refs.incrementAndGet();
+	return shared;
+}
+
+void EFiberStackPool::unbindShared(EFiberSharedStack* shared) {
+	shared->pool->unref();
+}
+
+int EFiberStackPool::cachedCount() {
+	int n = 0;
+	for (int i = 0; i < CLASS_COUNT; i++) {
+		n += freeCounts[i];
+	}
+	return n;
+}
+
+llong EFiberStackPool::cachedBytes() {
+	return freeBytes;
+}
+
+int EFiberStackPool::sizeClassOf(int size) {
+	int shift = MIN_CLASS_SHIFT;
+	while ((1 << shift) < size) {
+		if (++shift > MAX_CLASS_SHIFT) {
+			return -1;
+		}
+	}
+	return shift - MIN_CLASS_SHIFT;
+}
+
+EFiberStack* EFiberStackPool::take(int sizeClass) {
+	EFiberStack* stack = freeLists[sizeClass];
+	if (stack) {
+		freeLists[sizeClass] = stack->next;
+		freeCounts[sizeClass]--;
+		freeBytes -= stack->size();
+		stack->next = null;
+	}
+	return stack;
+}
+
+void EFiberStackPool::cache(EFiberStack* stack) {
+	int sizeClass = stack->sizeClass;
+	if (detached
+			|| freeCounts[sizeClass] >= maxStacksPerClass
+			|| freeBytes + stack->size() > maxCachedBytes) {
+		delete stack;
+		return;
+	}
+	stack->next = freeLists[sizeClass];
+	freeLists[sizeClass] = stack;
+	freeCounts[sizeClass]++;
+	freeBytes += stack->size();
+}
+
+void EFiberStackPool::drainReturns() {
+	returnLock.lock();
+	EFiberStack* stack = returnList;
+	returnList = null;
+	returnLock.unlock();
+
+	while (stack) {
+		EFiberStack* next = stack->next;
+		cache(stack);
+		refs.decrementAndGet();
+		stack = next;
+	}
+}
+
+void EFiberStackPool::purge() {
+	for (int i = 0; i < CLASS_COUNT; i++) {
+		EFiberStack* stack = freeLists[i];
+		while (stack) {
+			EFiberStack* next = stack->next;
+			delete stack;
+			stack = next;
+		}
+		freeLists[i] = null;
+		freeCounts[i] = 0;
+	}
+	freeBytes = 0;
+}
+
+void EFiberStackPool::unref() {
+	if (refs.decrementAndGet() == 0) {
+		delete this;
+	}
+}
+
+//=============================================================================
+
+EFiberStackProfiler::~EFiberStackProfiler() {
+	es_hash_index_t *hi;
+	void *key;
+	void *val;
+	for (hi = eso_hash_first(entries); hi; hi = eso_hash_next(hi)) {
+		eso_hash_this(hi, &key, NULL, &val);
+		free(val);
+	}
+	eso_hash_free(&entries);
+}
+
+EFiberStackProfiler::EFiberStackProfiler(int sampleRate, int marginPercent) :
+		count(0), sampleRate(sampleRate), marginPercent(marginPercent) {
+	entries = eso_hash_make(32, NULL);
+}
+
+void EFiberStackProfiler::setSampling(int sampleRate, int marginPercent) {
+	lock.lock();
+	this->sampleRate = sampleRate;
+	this->marginPercent = marginPercent;
+	lock.unlock();
+}
+
+boolean EFiberStackProfiler::prepare(const char* name, int* stackSize) {
+	boolean sample = false;
+	lock.lock();
+	Entry* e = lookup(name);
+	if (e) {
+		e->runs++;
+		if (e->samples >= WARMUP_SAMPLES
+				&& (sampleRate <= 0 || e->runs % sampleRate != 0)) {
+			*stackSize = ES_MIN(*stackSize, learnedSize(e));
+		} else {
+			sample = (sampleRate > 0);
+		}
+	}
+	lock.unlock();
+	return sample;
+}
+
+void EFiberStackProfiler::record(const char* name, int usedBytes) {
+	lock.lock();
+	Entry* e = lookup(name);
+	if (e) {
+		e->usedBytes = ES_MAX(e->usedBytes, usedBytes);
+		e->samples++;
+	}
+	lock.unlock();
+}
+
+EString EFiberStackProfiler::exportProfile() {
+	EString profile;
+	lock.lock();
+	es_hash_index_t *hi;
+	void *key;
+	void *val;
+	for (hi = eso_hash_first(entries); hi; hi = eso_hash_next(hi)) {
+		eso_hash_this(hi, &key, NULL, &val);
+		Entry* e = (Entry*)val;
+		if (e->samples >= WARMUP_SAMPLES) {
+			profile.append(EString::formatOf("%d %s\n", e->usedBytes, e->name).c_str());
+		}
+	}
+	lock.unlock();
+	return profile;
+}
+
+void EFiberStackProfiler::importProfile(const char* profile) {
+	const char* p = profile;
+	lock.lock();
+	while (p && *p) {
+		const char* eol = strchr(p, '\n');
+		const char* end = eol ? eol : p + strlen(p);
+		char* sp = null;
+		long used = strtol(p, &sp, 10);
+		if (sp > p && sp + 1 < end && *sp == ' ' && used > 0) {
+			EString name(sp + 1, 0, end - sp - 1);
+			Entry* e = lookup(name.c_str());
+			if (e) {
+				e->usedBytes = ES_MAX(e->usedBytes, (int)used);
+				e->samples = ES_MAX(e->samples, WARMUP_SAMPLES);
+			}
+		}
+		p = eol ? eol + 1 : null;
+	}
+	lock.unlock();
+}
+
+EFiberStackProfiler::Entry* EFiberStackProfiler::lookup(const char* name) {
+	Entry* e = (Entry*)eso_hash_get(entries, name, ES_HASH_KEY_STRING);
+	if (!e && count < MAX_NAMES) {
+		int len = strlen(name);
+		e = (Entry*)malloc(sizeof(Entry) + len);
+		e->usedBytes = 0;
+		e->samples = 0;
+		e->runs = 0;
+		memcpy(e->name, name, len + 1);
+		eso_hash_set(entries, e->name, ES_HASH_KEY_STRING, e);
+		count++;
+	}
+	return e;
+}
+
+int EFiberStackProfiler::learnedSize(Entry* e) {
+	llong size = (llong)e->usedBytes * (100 + marginPercent) / 100;
+	return ES_ALIGN_UP((int)size, EFiberStack::pageSize());
+}
+
+} /* namespace eco */
+} /* namespace efc */
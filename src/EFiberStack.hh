@@ -0,0 +1,266 @@
+/*
+ * EFiberStack.hh
+ *
+ *  Created on: 2026-10-16
+ *      Author: agent@local
+ */
+
+#ifndef EFIBERSTACK_HH_
+#define EFIBERSTACK_HH_
+
+#include "Efc.hh"
+#include "../inc/EFiberUtil.hh"
+
+namespace efc {
+namespace eco {
+
+/**
+ * Fiber stack: mmap'ed with MAP_NORESERVE and a PROT_NONE guard page
+ * at the low end, pages are committed only when they are touched.
+ *
+ * Note: each stack costs two kernel vm areas, the number of fibers
+ * alive at the same time is limited by vm.max_map_count/2 on linux.
+ */
+
+class EFiberStackPool;
+
+class EFiberStack {
+public:
+	~EFiberStack();
+
+	EFiberStack(int size);
+
+	/**
+	 * The lowest usable address.
+	 */
+	char* bottom();
+
+	/**
+	 * The highest address, stack grows down from here.
+	 */
+	char* top();
+
+	/**
+	 * Usable size, page aligned.
+	 */
+	int size();
+
+	/**
+	 * Test if the address is in the guard page.
+	 */
+	boolean isGuardAddress(void* addr);
+
+	/**
+	 * Give back the physical pages of [bottom, end) to the kernel, only
+	 * the whole pages, the range is still mapped and reads zero later.
+	 *
+	 * @return resident bytes released
+	 */
+	es_size_t decommit(char* end);
+
+	/**
+	 * Bytes from top down to the deepest page touched since the stack
+	 * was mapped or decommitted, the high-water mark of a clean stack.
+	 */
+	es_size_t usedBytes();
+
+	static int pageSize();
+
+private:
+	friend class EFiberStackPool;
+
+	static es_size_t residentBytes(char* from, char* to);
+
+	char* mapAddr; // the guard page
+	es_size_t mapSize;
+
+	EFiberStackPool* pool; // owner pool, null if not pooled
+	int sizeClass;
+	EFiberStack* next;
+};
+
+/**
+ * A big per-thread stack that many fibers run on in turn, the live slice
+ * of the fiber which leaves it is copied out to the fiber's own buffer.
+ */
+
+class EFiberSharedStack {
+public:
+	EFiberStack* stack;
+	void* occupant; // the EContext whose slice is on the stack now
+
+private:
+	friend class EFiberStackPool;
+
+	EFiberStackPool* pool;
+
+	EFiberSharedStack(EFiberStackPool* pool, int size);
+	~EFiberSharedStack();
+};
+
+/**
+ * Per-thread stack cache by power-of-two size class, attached to a
+ * scheduler thread for its join() lifetime.
+ *
+ * Stacks released by the owner thread go back to its free lists, stacks
+ * released by other threads go to a locked return list which the owner
+ * drains on allocate.
+ */
+
+class EFiberStackPool {
+public:
+	static const int MIN_CLASS_SHIFT = 13; // 8K
+	static const int MAX_CLASS_SHIFT = 23; // 8M
+	static const int CLASS_COUNT = MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1;
+
+	static const int DEFAULT_MAX_STACKS_PER_CLASS = 1024;
+	static const llong DEFAULT_MAX_CACHED_BYTES = 256LL * 1024 * 1024;
+
+	/**
+	 * Attach a new pool to the current thread.
+	 */
+	static EFiberStackPool* attach(int maxStacksPerClass, llong maxCachedBytes);
+
+	/**
+	 * Detach the current thread's pool, cached stacks are freed and
+	 * stacks still in use are freed when they are released.
+	 */
+	static void detach();
+
+	/**
+	 * The current thread's pool or null.
+	 */
+	static EFiberStackPool* current();
+
+	/**
+	 * Get a stack from the current thread's pool, or a new unpooled
+	 * one if the thread has no pool.
+	 */
+	static EFiberStack* allocate(int size);
+
+	/**
+	 * Give back a stack from any thread.
+	 */
+	static void release(EFiberStack* stack);
+
+	/**
+	 * Cache n pre-faulted stacks of size, still bounded by the caps.
+	 */
+	void prewarm(int n, int size);
+
+	/**
+	 * Create count shared stacks of size for this thread.
+	 */
+	void setSharedStacks(int count, int size);
+
+	/**
+	 * Bind a shared stack of the current thread in round robin,
+	 * null if the thread has none or size is bigger than them.
+	 */
+	static EFiberSharedStack* bindShared(int size);
+
+	/**
+	 * Unbind from any thread.
+	 */
+	static void unbindShared(EFiberSharedStack* shared);
+
+	int cachedCount();
+	llong cachedBytes();
+
+private:
+	EFiberStack* freeLists[CLASS_COUNT];
+	int freeCounts[CLASS_COUNT];
+	llong freeBytes;
+
+	int maxStacksPerClass;
+	llong maxCachedBytes;
+
+	EFiberSharedStack** sharedStacks;
+	int sharedCount;
+	int sharedIndex;
+
+	// cross-thread return path.
+	SpinLock returnLock;
+	EFiberStack* returnList;
+	boolean detached;
+
+	// 1 for the owner thread + stacks not in free lists + shared binds.
+	EAtomicInteger refs;
+
+	static EThreadLocalStorage threadLocal;
+
+	EFiberStackPool(int maxStacksPerClass, llong maxCachedBytes);
+	~EFiberStackPool();
+
+	static int sizeClassOf(int size);
+
+	EFiberStack* take(int sizeClass);
+	void cache(EFiberStack* stack);
+	void drainReturns();
+	void purge();
+	void unref();
+};
+
+/**
+ * Learned stack sizes of fibers by name, shared by all scheduler threads.
+ *
+ * One of every sampleRate fibers of a name runs on its requested size on a
+ * clean stack and reports the high-water mark at termination, the others
+ * run on the largest mark seen plus marginPercent once WARMUP_SAMPLES
+ * fibers have been measured.
+ */
+
+class EFiberStackProfiler {
+public:
+	static const int WARMUP_SAMPLES = 8;
+	static const int MAX_NAMES = 4096;
+
+	~EFiberStackProfiler();
+
+	EFiberStackProfiler(int sampleRate, int marginPercent);
+
+	void setSampling(int sampleRate, int marginPercent);
+
+	/**
+	 * Pick the stack size of a named fiber before its first run.
+	 *
+	 * @return true if the fiber should be sampled on its requested size
+	 */
+	boolean prepare(const char* name, int* stackSize);
+
+	/**
+	 * Record the high-water mark of a sampled fiber.
+	 */
+	void record(const char* name, int usedBytes);
+
+	/**
+	 * One "<size> <name>" line for each learned name.
+	 */
+	EString exportProfile();
+
+	/**
+	 * Load the lines of exportProfile() as learned sizes.
+	 */
+	void importProfile(const char* profile);
+
+private:
+	struct Entry {
+		int usedBytes; // the largest high-water mark
+		int samples;
+		uint runs;
+		char name[1];
+	};
+
+	SpinLock lock;
+	es_hash_t* entries;
+	int count;
+	int sampleRate; // <= 0 applies learned sizes only
+	int marginPercent;
+
+	Entry* lookup(const char* name);
+	int learnedSize(Entry* e);
+};
+
+} /* namespace eco */
+} /* namespace efc */
+#endif /* EFIBERSTACK_HH_ */
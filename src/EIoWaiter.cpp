@@ -6,9 +6,13 @@
  */
 
 #include "./EIoWaiter.hh"
+#include "./EContext.hh"
 #include "../inc/EFiberDebugger.hh"
 
 #include <sys/resource.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 namespace efc {
 namespace eco {
@@ -21,27 +25,42 @@ typedef ssize_t (*write_t)(int fd, const void *buf, size_t count);
 extern write_t write_f;
 } //!C
 
-static void pipeEventProc(co_poll_t *poll, int fd, void *clientData, int mask) {
-	char buf[32];
-	int n;
-	RESTARTABLE(read_f(fd, buf, sizeof(buf)), n);
-
-	ECO_DEBUG(EFiberDebugger::WAITING, "io waiter signaled.");
-}
-
 //=============================================================================
 
 EIoWaiter::~EIoWaiter() {
 	eco_poll_destroy(&poll);
-	eso_pipe_destroy(&pipe);
+	if (pipe) {
+		eso_pipe_destroy(&pipe);
+	} else {
+		::close(wakeupFd);
+	}
 }
 
-EIoWaiter::EIoWaiter(int iosetSize): waiters(0) {
+EIoWaiter::EIoWaiter(int iosetSize): pipe(null), wakeupFd(-1), waiters(0),
+		signaled(0), signalsIssued(0), signalsSuppressed(0) {
 	poll = eco_poll_create(iosetSize);
-	pipe = eso_pipe_create();
+#ifdef __linux__
+	wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+	if (wakeupFd < 0) {
+		pipe = eso_pipe_create();
+		wakeupFd = eso_fileno(pipe->in);
+	}
 
-	// register pipe for poll wakeup.
-	eco_poll_file_event_update(poll, eso_fileno(pipe->in), ECO_POLL_READABLE, pipeEventProc, NULL);
+	// register for poll wakeup.
+	eco_poll_file_event_update(poll, wakeupFd, ECO_POLL_READABLE, wakeupEventProc, this);
+}
+
+void EIoWaiter::wakeupEventProc(co_poll_t *poll, int fd, void *clientData, int mask) {
+	EIoWaiter* self = (EIoWaiter*)clientData;
+	char buf[32];
+	int n;
+	RESTARTABLE(read_f(fd, buf, sizeof(buf)), n);
+
+	// clear it after the drain, a later signal writes again.
+	__atomic_store_n(&self->signaled, 0, __ATOMIC_RELEASE);
+
+	ECO_DEBUG(EFiberDebugger::WAITING, "io waiter signaled.");
 }
 
 void EIoWaiter::loopProcessEvents() {
@@ -73,6 +92,7 @@ void EIoWaiter::setFileEvent(int fd, int mask, sp<EFiber> fiber) {
 
 	waiters++;
 
+	fiber->waitingSince = ESystem::currentTimeMillis();
 	fiber->state = EFiber::WAITING; // will be hang!
 	ECO_DEBUG(EFiberDebugger::WAITING, "fiber[%s] will waiting.", fiber->toString().c_str());
 }
@@ -142,9 +162,79 @@ boolean EIoWaiter::swapOut(sp<EFiber>& fiber) {
 }
 
 void EIoWaiter::signal() {
-	int fd = eso_fileno(pipe->out);
+	if (__atomic_exchange_n(&signaled, 1, __ATOMIC_ACQ_REL)) {
+		__atomic_fetch_add(&signalsSuppressed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	__atomic_fetch_add(&signalsIssued, 1, __ATOMIC_RELAXED);
+
 	int n;
-	RESTARTABLE(write_f(fd, "\0xF1", 1), n);
+	if (pipe) {
+		RESTARTABLE(write_f(eso_fileno(pipe->out), "\0xF1", 1), n);
+	} else {
+		uint64_t one = 1;
+		RESTARTABLE(write_f(wakeupFd, &one, sizeof(one)), n);
+	}
+}
+
+llong EIoWaiter::getSignalsIssued() {
+	return signalsIssued;
+}
+
+llong EIoWaiter::getSignalsSuppressed() {
+	return signalsSuppressed;
+}
+
+es_size_t EIoWaiter::hibernateVisitor(EFiber* fiber, void* arg) {
+	return (fiber->waitingSince <= *(llong*)arg) ? fiber->context->hibernate() : 0;
+}
+
+es_size_t EIoWaiter::trimVisitor(EFiber* fiber, void* arg) {
+	return fiber->context->trim();
+}
+
+llong EIoWaiter::hibernate(llong idleMillis, int* count) {
+	llong deadline = ESystem::currentTimeMillis() - idleMillis;
+	return visitWaitingFibers(hibernateVisitor, &deadline, false, count);
+}
+
+llong EIoWaiter::trim(int* count) {
+	return visitWaitingFibers(trimVisitor, NULL, true, count);
+}
+
+llong EIoWaiter::visitWaitingFibers(fiber_visitor_t* visitor, void* arg,
+		boolean withTimers, int* count) {
+	llong bytes = 0;
+	*count = 0;
+	for (int fd = 0; fd <= poll->maxfd; fd++) {
+		coFileEvent *fe = &poll->events[fd];
+		if (fe->mask == ECO_POLL_NONE || !fe->clientData ||
+				(fe->rfileProc != fileEventProc && fe->wfileProc != fileEventProc)) {
+			continue; // the wakeup fd has this waiter as its client data.
+		}
+		EFiber* fiber = (*(sp<EFiber>*)fe->clientData).get();
+		if (fiber->state == EFiber::WAITING) {
+			es_size_t n = visitor(fiber, arg);
+			if (n > 0) {
+				bytes += n;
+				(*count)++;
+			}
+		}
+	}
+	for (coTimeEvent *te = poll->timeEventHead; withTimers && te; te = te->next) {
+		if (te->id == ECO_POLL_DELETED_EVENT_ID || te->timeProc != timeEventProc) {
+			continue;
+		}
+		EFiber* fiber = (*(sp<EFiber>*)te->clientData).get();
+		if (fiber->state == EFiber::WAITING) {
+			es_size_t n = visitor(fiber, arg);
+			if (n > 0) {
+				bytes += n;
+				(*count)++;
+			}
+		}
+	}
+	return bytes;
 }
 
 } /* namespace eco */
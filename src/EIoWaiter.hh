@@ -61,15 +61,49 @@ public:
 	boolean swapOut(sp<EFiber>& fiber);
 
 	/**
-	 *
+	 * Wake up the thread polling this waiter, a signal is skipped when
+	 * the last one is not consumed yet.
 	 */
 	void signal();
 
+	llong getSignalsIssued();
+	llong getSignalsSuppressed();
+
+	/**
+	 * Hibernate the stacks of fibers which wait for file events
+	 * longer than idleMillis.
+	 *
+	 * @return resident bytes released, count is the fibers hibernated
+	 */
+	llong hibernate(llong idleMillis, int* count);
+
+	/**
+	 * Trim the stacks of fibers which wait for file or timer events.
+	 *
+	 * @return resident bytes released, count is the fibers trimmed
+	 */
+	llong trim(int* count);
+
 private:
 	co_poll_t* poll;
-	es_pipe_t* pipe;
+	es_pipe_t* pipe; // null if wakeupFd is an eventfd
+	int wakeupFd;
 	int waiters;
 
+	volatile int signaled; // a wakeup is pending
+	volatile llong signalsIssued;
+	volatile llong signalsSuppressed;
+
+	static void wakeupEventProc(co_poll_t *poll, int fd, void *clientData, int mask);
+
+	typedef es_size_t fiber_visitor_t(EFiber* fiber, void* arg);
+
+	llong visitWaitingFibers(fiber_visitor_t* visitor, void* arg,
+			boolean withTimers, int* count);
+
+	static es_size_t hibernateVisitor(EFiber* fiber, void* arg);
+	static es_size_t trimVisitor(EFiber* fiber, void* arg);
+
 	static void fileEventProc(co_poll_t *poll, int fd, void *clientData, int mask);
 	static int  timeEventProc(co_poll_t *poll, llong id, void *clientData);
 	static void timeEventFinalizerProc(co_poll_t *poll, void *clientData);
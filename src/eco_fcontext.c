@@ -0,0 +1,234 @@
+/*
+ * eco_fcontext.c
+ *
+ *  Created on: 2026-10-16
+ *      Author: agent@local
+ */
+
+#include "eco_fcontext.h"
+
+#ifdef __APPLE__
+# define ECO_ASM_SYM(name) "_" #name
+# define ECO_ASM_TYPE(name)
+# define ECO_ASM_SIZE(name)
+#else
+# define ECO_ASM_SYM(name) #name
+# define ECO_ASM_TYPE(name) ".type " #name ", %function\n"
+# define ECO_ASM_SIZE(name) ".size " #name ", .-" #name "\n"
+#endif
+
+#if defined(__x86_64__)
+
+/*
+ * Frame layout of a saved context (from the saved rsp):
+ *
+ *  0x00: r12
+ *  0x08: r13
+ *  0x10: r14
+ *  0x18: r15
+ *  0x20: rbx
+ *  0x28: rbp
+ *  0x30: rip (return address)
+ *  0x38: fake return address of fn (new context only)
+ *
+ * Like the old SETJMP/LONGJMP path, mxcsr and the x87 control word
+ * are not switched: reloading them costs more than the whole switch.
+ */
+
+__asm__ (
+	".text\n"
+	".globl " ECO_ASM_SYM(eco_jump_fcontext) "\n"
+	ECO_ASM_TYPE(eco_jump_fcontext)
+	".p2align 4\n"
+	ECO_ASM_SYM(eco_jump_fcontext) ":\n"
+	"    pushq  %rbp\n"
+	"    pushq  %rbx\n"
+	"    pushq  %r15\n"
+	"    pushq  %r14\n"
+	"    pushq  %r13\n"
+	"    pushq  %r12\n"
+	/* *ofc = rsp, then switch to nfc */
+	"    movq   %rsp, (%rdi)\n"
+	"    movq   %rsi, %rsp\n"
+	"    popq   %r12\n"
+	"    popq   %r13\n"
+	"    popq   %r14\n"
+	"    popq   %r15\n"
+	"    popq   %rbx\n"
+	"    popq   %rbp\n"
+	"    popq   %r8\n"
+	/* vp is the return value, or the first arg of fn */
+	"    movq   %rdx, %rax\n"
+	"    movq   %rdx, %rdi\n"
+	"    jmp    *%r8\n"
+	ECO_ASM_SIZE(eco_jump_fcontext)
+);
+
+__asm__ (
+	".text\n"
+	".globl " ECO_ASM_SYM(eco_make_fcontext) "\n"
+	ECO_ASM_TYPE(eco_make_fcontext)
+	".p2align 4\n"
+	ECO_ASM_SYM(eco_make_fcontext) ":\n"
+	/* 16 bytes align the stack top, then reserve the frame, fn is
+	 * entered with rsp % 16 == 8 as if it was called. */
+	"    movq   %rdi, %rax\n"
+	"    andq   $-16, %rax\n"
+	"    leaq   -0x40(%rax), %rax\n"
+	"    movq   $0, 0x28(%rax)\n"
+	"    movq   %rdx, 0x30(%rax)\n"
+	"    leaq   1f(%rip), %rcx\n"
+	"    movq   %rcx, 0x38(%rax)\n"
+	"    ret\n"
+	/* fn returned: nothing to go back to */
+	"1:\n"
+	"    hlt\n"
+	ECO_ASM_SIZE(eco_make_fcontext)
+);
+
+#elif defined(__i386__)
+
+/*
+ * Frame layout of a saved context (from the saved esp):
+ *
+ *  0x00: edi
+ *  0x04: esi
+ *  0x08: ebx
+ *  0x0c: ebp
+ *  0x10: eip (return address)
+ *  0x14: fake return address of fn (new context only)
+ *  0x18: vp, the argument of fn (new context only)
+ */
+
+__asm__ (
+	".text\n"
+	".globl " ECO_ASM_SYM(eco_jump_fcontext) "\n"
+	ECO_ASM_TYPE(eco_jump_fcontext)
+	".p2align 4\n"
+	ECO_ASM_SYM(eco_jump_fcontext) ":\n"
+	"    pushl  %ebp\n"
+	"    pushl  %ebx\n"
+	"    pushl  %esi\n"
+	"    pushl  %edi\n"
+	/* *ofc = esp, then switch to nfc */
+	"    movl   0x14(%esp), %eax\n"
+	"    movl   %esp, (%eax)\n"
+	"    movl   0x18(%esp), %ecx\n"
+	"    movl   0x1c(%esp), %eax\n"
+	"    movl   %ecx, %esp\n"
+	"    popl   %edi\n"
+	"    popl   %esi\n"
+	"    popl   %ebx\n"
+	"    popl   %ebp\n"
+	"    popl   %ecx\n"
+	/* vp is the return value, or the first arg of fn (the arg slots
+	 * belong to the callee for a saved context) */
+	"    movl   %eax, 0x4(%esp)\n"
+	"    jmp    *%ecx\n"
+	ECO_ASM_SIZE(eco_jump_fcontext)
+);
+
+__asm__ (
+	".text\n"
+	".globl " ECO_ASM_SYM(eco_make_fcontext) "\n"
+	ECO_ASM_TYPE(eco_make_fcontext)
+	".p2align 4\n"
+	ECO_ASM_SYM(eco_make_fcontext) ":\n"
+	/* 16 bytes align the stack top, then reserve the frame, fn is
+	 * entered with its arg slot 16 bytes aligned as if it was called. */
+	"    movl   0x4(%esp), %eax\n"
+	"    andl   $-16, %eax\n"
+	"    leal   -0x28(%eax), %eax\n"
+	"    movl   $0, 0xc(%eax)\n"
+	"    movl   0xc(%esp), %edx\n"
+	"    movl   %edx, 0x10(%eax)\n"
+	"    call   2f\n"
+	"2:\n"
+	"    popl   %ecx\n"
+	"    addl   $1f-2b, %ecx\n"
+	"    movl   %ecx, 0x14(%eax)\n"
+	"    ret\n"
+	/* fn returned: nothing to go back to */
+	"1:\n"
+	"    hlt\n"
+	ECO_ASM_SIZE(eco_make_fcontext)
+);
+
+#elif defined(__aarch64__)
+
+/*
+ * Frame layout of a saved context (from the saved sp):
+ *
+ *  0x00: d8,  d9
+ *  0x10: d10, d11
+ *  0x20: d12, d13
+ *  0x30: d14, d15
+ *  0x40: x19, x20
+ *  0x50: x21, x22
+ *  0x60: x23, x24
+ *  0x70: x25, x26
+ *  0x80: x27, x28
+ *  0x90: x29, x30
+ *  0xa0: pc
+ */
+
+__asm__ (
+	".text\n"
+	".globl " ECO_ASM_SYM(eco_jump_fcontext) "\n"
+	ECO_ASM_TYPE(eco_jump_fcontext)
+	".p2align 4\n"
+	ECO_ASM_SYM(eco_jump_fcontext) ":\n"
+	"    sub    sp, sp, #0xb0\n"
+	"    stp    d8,  d9,  [sp, #0x00]\n"
+	"    stp    d10, d11, [sp, #0x10]\n"
+	"    stp    d12, d13, [sp, #0x20]\n"
+	"    stp    d14, d15, [sp, #0x30]\n"
+	"    stp    x19, x20, [sp, #0x40]\n"
+	"    stp    x21, x22, [sp, #0x50]\n"
+	"    stp    x23, x24, [sp, #0x60]\n"
+	"    stp    x25, x26, [sp, #0x70]\n"
+	"    stp    x27, x28, [sp, #0x80]\n"
+	"    stp    x29, x30, [sp, #0x90]\n"
+	"    str    x30, [sp, #0xa0]\n"
+	/* *ofc = sp, then switch to nfc */
+	"    mov    x4, sp\n"
+	"    str    x4, [x0]\n"
+	"    mov    sp, x1\n"
+	"    ldp    d8,  d9,  [sp, #0x00]\n"
+	"    ldp    d10, d11, [sp, #0x10]\n"
+	"    ldp    d12, d13, [sp, #0x20]\n"
+	"    ldp    d14, d15, [sp, #0x30]\n"
+	"    ldp    x19, x20, [sp, #0x40]\n"
+	"    ldp    x21, x22, [sp, #0x50]\n"
+	"    ldp    x23, x24, [sp, #0x60]\n"
+	"    ldp    x25, x26, [sp, #0x70]\n"
+	"    ldp    x27, x28, [sp, #0x80]\n"
+	"    ldp    x29, x30, [sp, #0x90]\n"
+	"    ldr    x4, [sp, #0xa0]\n"
+	"    add    sp, sp, #0xb0\n"
+	/* vp is the return value, or the first arg of fn */
+	"    mov    x0, x2\n"
+	"    ret    x4\n"
+	ECO_ASM_SIZE(eco_jump_fcontext)
+);
+
+__asm__ (
+	".text\n"
+	".globl " ECO_ASM_SYM(eco_make_fcontext) "\n"
+	ECO_ASM_TYPE(eco_make_fcontext)
+	".p2align 4\n"
+	ECO_ASM_SYM(eco_make_fcontext) ":\n"
+	/* 16 bytes align the stack top, then reserve the frame. */
+	"    and    x0, x0, #-16\n"
+	"    sub    x0, x0, #0xb0\n"
+	"    str    x2, [x0, #0xa0]\n"
+	"    adr    x3, 1f\n"
+	"    stp    xzr, x3, [x0, #0x90]\n"
+	"    ret\n"
+	/* fn returned: nothing to go back to */
+	"1:\n"
+	"    brk    #0\n"
+	ECO_ASM_SIZE(eco_make_fcontext)
+);
+
+#endif //!__x86_64__ | __i386__ | __aarch64__
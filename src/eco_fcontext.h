@@ -0,0 +1,42 @@
+/*
+ * eco_fcontext.h
+ *
+ *  Created on: 2026-10-16
+ *      Author: agent@local
+ */
+
+#ifndef __ECO_FCONTEXT_H__
+#define __ECO_FCONTEXT_H__
+
+#include "es_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Register-only context switch, never enters the kernel.
+ * @see: boost.context make_fcontext()/jump_fcontext()
+ */
+
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+#define ECO_HAVE_FCONTEXT 1
+#endif
+
+typedef void* eco_fcontext_t;
+
+typedef void eco_fcontext_fn_t(void* vp);
+
+/* Build a new context at the top of stack [sp - size, sp), the first
+ * jump to it will call fn(vp); fn must never return. */
+eco_fcontext_t eco_make_fcontext(void* sp, es_size_t size, eco_fcontext_fn_t* fn);
+
+/* Save the current context to *ofc and jump to nfc, vp is passed to
+ * the fn of a new context or returned from the jump of a saved one. */
+void* eco_jump_fcontext(eco_fcontext_t* ofc, eco_fcontext_t nfc, void* vp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //!__ECO_FCONTEXT_H__
@@ -1,6 +1,8 @@
 #include "es_main.h"
 #include "Eco.hh"
 
+#include <unistd.h>
+
 #define LOG(fmt,...) ESystem::out->printfln(fmt, ##__VA_ARGS__)
 
 //=============================================================================
@@ -49,6 +51,839 @@ static void test_scheduling_performance() {
 #endif
 }
 
+//=============================================================================
+//linux: per second spawn times: 3115264.797508 (no stack pool: 1718213.058419, getcontext/makecontext: 552181.115406)
+
+static void test_spawn_performance() {
+#ifdef CPP11_SUPPORT
+	EFiberDebugger::getInstance().debugOn(EFiberDebugger::NONE);
+
+	EFiberScheduler scheduler;
+
+	llong t1 = ESystem::currentTimeMillis();
+
+	int times = 1000000;
+	int count = 0;
+
+	scheduler.schedule([&]() {
+		for (int i=0; i<times; i++) {
+			scheduler.schedule([&]() {
+				count++;
+			}, 64*1024);
+
+			// let the children run and die.
+			if (i % 100 == 99) {
+				EFiber::yield();
+			}
+		}
+	});
+
+	scheduler.join();
+
+	llong t2 = ESystem::currentTimeMillis();
+
+	LOG("spawn %d fibers, cost %ld ms\nper second spawn times: %f", count, t2 - t1, ((double)count)/(t2-t1)*1000);
+#endif
+}
+
+//=============================================================================
+//10000 parked fibers (1 of 100 used 64K stack), rss per fiber, then the switch
+//cost of 10 fibers on the same stacks:
+//linux fixed stack: 4798 bytes, per second op times: 10869565.217391
+//linux split stack: 17114 bytes, per second op times: 7874015.748031 (make SPLIT_STACK=1)
+
+static int stack_eater(int depth) {
+	char buf[1024];
+	memset(buf, depth, sizeof(buf));
+	return (depth > 0) ? stack_eater(depth - 1) + buf[depth % sizeof(buf)] : 0;
+}
+
+static llong resident_kbytes() {
+	long size = 0, resident = 0;
+	FILE* f = fopen("/proc/self/statm", "r");
+	if (f) {
+		fscanf(f, "%ld %ld", &size, &resident);
+		fclose(f);
+	}
+	return (llong)resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void test_stack_memory_performance() {
+#ifdef CPP11_SUPPORT
+	EFiberDebugger::getInstance().debugOn(EFiberDebugger::NONE);
+
+	EFiberScheduler scheduler;
+
+	int count = 10000;
+	int parked = 0;
+	llong rss0 = resident_kbytes();
+	llong rss1 = 0;
+
+	for (int i=0; i<count; i++) {
+		scheduler.schedule([&, i]() {
+			// 1 of 100 fibers goes deep.
+			int r = stack_eater((i % 100 == 0) ? 64 : 2);
+			parked++;
+			EFiber::sleep(1000);
+			r++;
+		}, 128*1024);
+	}
+	scheduler.schedule([&]() {
+		while (parked < count) {
+			EFiber::sleep(10);
+		}
+		rss1 = resident_kbytes();
+	});
+
+	llong t1 = ESystem::currentTimeMillis();
+	scheduler.join();
+	llong t2 = ESystem::currentTimeMillis();
+
+	LOG("%d parked fibers, rss: +%lld KB (%lld bytes per fiber), cost %ld ms", count, rss1 - rss0, (rss1 - rss0) * 1024 / count, t2 - t1);
+
+	// a call on each run, the stack checks of the split stack build count too.
+	EFiberScheduler switcher;
+	int times = 1000000;
+	int switches = times;
+	for (int i=0; i<10; i++) {
+		switcher.schedule([&]() {
+			while (switches-- > 0) {
+				stack_eater(2);
+				EFiber::yield();
+			}
+		}, 128*1024);
+	}
+	t1 = ESystem::currentTimeMillis();
+	switcher.join();
+	t2 = ESystem::currentTimeMillis();
+
+	LOG("switch 10 fibers run %d times, cost %ld ms\nper second op times: %f", times, t2 - t1, ((double)times)/ES_MAX(t2-t1, 1)*1000);
+#endif
+}
+
+//=============================================================================
+//4 threads, all fibers balanced to thread 0, 40 fibers of 20us work per ms.
+//The gain of stealing on several cores is UNVERIFIED, it was only run on a
+//1 cpu linux box where the hand-offs are pure cost and make it worse:
+//  no stealing: p50 446 us, p99 852 us
+//  stealing   : p50 494 us, p99 3101 us, stolen 19500
+
+static int llong_compare(const void* a, const void* b) {
+	llong x = *(llong*)a, y = *(llong*)b;
+	return (x > y) - (x < y);
+}
+
+static void skewed_load(boolean stealing) {
+#ifdef CPP11_SUPPORT
+	EFiberScheduler scheduler;
+	scheduler.setWorkStealing(stealing);
+	scheduler.setIoPollPolicy(EFiberScheduler::IO_POLL_ADAPTIVE);
+	scheduler.setBalanceCallback([](EFiber* fiber, int threadNums) {
+		return 0;
+	});
+
+	const int bursts = 500;
+	const int burstSize = 40;
+	llong* latencies = new llong[bursts * burstSize];
+
+	scheduler.schedule([&]() {
+		for (int b=0; b<bursts; b++) {
+			for (int i=0; i<burstSize; i++) {
+				int n = b * burstSize + i;
+				llong t0 = ESystem::nanoTime();
+				scheduler.schedule([=]() {
+					// 20us of work.
+					llong t1 = ESystem::nanoTime();
+					while (ESystem::nanoTime() - t1 < 20000) {
+					}
+					latencies[n] = (ESystem::nanoTime() - t0) / 1000;
+				});
+			}
+			EFiber::sleep(1);
+		}
+	});
+
+	scheduler.join(4);
+
+	int count = bursts * burstSize;
+	qsort(latencies, count, sizeof(llong), llong_compare);
+	LOG("%s: p50 %lld us, p99 %lld us, stolen %lld", stealing ? "stealing   " : "no stealing",
+			latencies[count / 2], latencies[count * 99 / 100], scheduler.getStats().stolenFibers);
+	delete[] latencies;
+#endif
+}
+
+static void test_work_stealing_performance() {
+	EFiberDebugger::getInstance().debugOn(EFiberDebugger::NONE);
+
+	skewed_load(false);
+	skewed_load(true);
+}
+
+//=============================================================================
+//yield: 10 fibers yield 1M times next to 100 sleeping fibers.
+//io   : 16 pipe pairs ping-pong 100K times next to 4 yielding fibers.
+//linux:
+//  each run: yield 252398/s (polls 1039709), io 144092/s (polls 250011)
+//  budget  : yield 5813953/s (polls 15656), io 216920/s (polls 12502)
+//  adaptive: yield 5813953/s (polls 15660), io 200000/s (polls 12506)
+
+static void io_poll_load(EFiberScheduler::IoPollPolicy policy, const char* name) {
+#ifdef CPP11_SUPPORT
+	int times = 1000000;
+	llong t1, t2, yieldPolls, ioPolls;
+	{
+		EFiberScheduler scheduler;
+		scheduler.setIoPollPolicy(policy);
+
+		int count = times;
+		for (int i=0; i<100; i++) {
+			scheduler.schedule([&]() {
+				while (count > 0) {
+					EFiber::sleep(10);
+				}
+			});
+		}
+		for (int i=0; i<10; i++) {
+			scheduler.schedule([&]() {
+				while (count-- > 0) {
+					EFiber::yield();
+				}
+			});
+		}
+
+		t1 = ESystem::currentTimeMillis();
+		scheduler.join();
+		t2 = ESystem::currentTimeMillis();
+		yieldPolls = scheduler.getStats().ioPolls;
+	}
+	double yieldRate = ((double)times)/(t2-t1)*1000;
+
+	int pairs = 16;
+	int rounds = 100000 / pairs;
+	{
+		EFiberScheduler scheduler;
+		scheduler.setIoPollPolicy(policy);
+
+		int done = 0;
+		for (int i=0; i<pairs; i++) {
+			int ping[2], pong[2];
+			pipe(ping);
+			pipe(pong);
+			scheduler.schedule([=, &done]() {
+				char c = 0;
+				for (int j=0; j<rounds; j++) {
+					write(ping[1], &c, 1);
+					read(pong[0], &c, 1);
+				}
+				close(ping[1]);
+				close(pong[0]);
+				done++;
+			});
+			scheduler.schedule([=]() {
+				char c;
+				for (int j=0; j<rounds; j++) {
+					read(ping[0], &c, 1);
+					write(pong[1], &c, 1);
+				}
+				close(ping[0]);
+				close(pong[1]);
+			});
+		}
+		for (int i=0; i<4; i++) {
+			scheduler.schedule([&]() {
+				while (done < pairs) {
+					EFiber::yield();
+				}
+			});
+		}
+
+		t1 = ESystem::currentTimeMillis();
+		scheduler.join();
+		t2 = ESystem::currentTimeMillis();
+		ioPolls = scheduler.getStats().ioPolls;
+	}
+	double ioRate = ((double)pairs * rounds)/(t2-t1)*1000;
+
+	LOG("%s: yield %.0f/s (polls %lld), io %.0f/s (polls %lld)", name, yieldRate, yieldPolls, ioRate, ioPolls);
+#endif
+}
+
+static void test_io_poll_performance() {
+	EFiberDebugger::getInstance().debugOn(EFiberDebugger::NONE);
+
+	io_poll_load(EFiberScheduler::IO_POLL_EACH_RUN, "each run");
+	io_poll_load(EFiberScheduler::IO_POLL_BUDGET, "budget  ");
+	io_poll_load(EFiberScheduler::IO_POLL_ADAPTIVE, "adaptive");
+}
+
+//=============================================================================
+//2 threads, a fiber on thread 0 schedules a fiber to the idle thread 1 each 20us.
+//The gain of spinning on several cores is UNVERIFIED, it was only run on a 1 cpu
+//linux box where the spinner can only take the producer's cpu and makes it worse:
+//  park at once: p50 3 us, p99 3562 us
+//  spin 50us   : p50 993 us, p99 4301 us
+
+static void cross_thread_wakeup(llong spinMicros, const char* name) {
+#ifdef CPP11_SUPPORT
+	EFiberScheduler scheduler;
+	scheduler.setIdlePolicy(spinMicros, 0);
+	scheduler.setBalanceCallback([](EFiber* fiber, int threadNums) {
+		return (fiber->getTag() == 1) ? 1 : 0;
+	});
+
+	const int count = 20000;
+	llong* latencies = new llong[count];
+
+	scheduler.schedule([&]() {
+		for (int i=0; i<count; i++) {
+			llong t0 = ESystem::nanoTime();
+			sp<EFiber> fiber = new EFiberTarget([=]() {
+				latencies[i] = (ESystem::nanoTime() - t0) / 1000;
+			});
+			fiber->setTag(1);
+			scheduler.schedule(fiber);
+			// 20us apart, the idle thread spins over it.
+			while (ESystem::nanoTime() - t0 < 20000) {
+			}
+		}
+	});
+
+	scheduler.join(2);
+
+	qsort(latencies, count, sizeof(llong), llong_compare);
+	EFiberScheduler::Stats stats = scheduler.getStats(1);
+	LOG("%s: p50 %lld us, p99 %lld us (spin %lld, yield %lld, park %lld)", name,
+			latencies[count / 2], latencies[count * 99 / 100],
+			stats.idleSpinWakeups, stats.idleYieldWakeups, stats.idleParks);
+	delete[] latencies;
+#endif
+}
+
+static void test_idle_policy_performance() {
+	EFiberDebugger::getInstance().debugOn(EFiberDebugger::NONE);
+
+	cross_thread_wakeup(0, "park at once");
+	cross_thread_wakeup(50, "spin 50us   ");
+}
+
+//=============================================================================
+//2 threads, a fiber on thread 0 schedules 200000 fibers to thread 1 in bursts:
+//linux (pipe wakeups: burst 1 795 ms, burst 64 224 ms):
+//  burst 1  : 200000 fibers in 620 ms, wakeups issued 200001, suppressed 0
+//  burst 64 : 200000 fibers in 106 ms, wakeups issued 7499, suppressed 192438
+
+static void burst_wakeup(int burst, const char* name) {
+#ifdef CPP11_SUPPORT
+	EFiberScheduler scheduler;
+	scheduler.setBalanceCallback([](EFiber* fiber, int threadNums) {
+		return (fiber->getTag() == 1) ? 1 : 0;
+	});
+
+	const int count = 200000;
+	EAtomicCounter done;
+
+	llong t0 = ESystem::nanoTime();
+	scheduler.schedule([&]() {
+		for (int i=0; i<count; i++) {
+			sp<EFiber> fiber = new EFiberTarget([&]() {
+				done++;
+			});
+			fiber->setTag(1);
+			scheduler.schedule(fiber);
+			if ((i + 1) % burst == 0) {
+				EThread::yield(); // let thread 1 drain the burst.
+			}
+		}
+	});
+
+	scheduler.join(2);
+	llong ms = (ESystem::nanoTime() - t0) / 1000000;
+
+	EFiberScheduler::Stats stats = scheduler.getStats(1);
+	LOG("%s: %d fibers in %lld ms, wakeups issued %lld, suppressed %lld", name,
+			done.value(), ms, stats.wakeupsIssued, stats.wakeupsSuppressed);
+#endif
+}
+
+static void test_wakeup_coalescing_performance() {
+	EFiberDebugger::getInstance().debugOn(EFiberDebugger::NONE);
+
+	burst_wakeup(1, "burst 1  ");
+	burst_wakeup(64, "burst 64 ");
+}
+
+//=============================================================================
+//linux: join(4) each round: 300 us, start(4) once and join() each round: 7 us
+
+static void test_worker_pool_performance() {
+	EFiberDebugger::getInstance().debugOn(EFiberDebugger::NONE);
+
+#ifdef CPP11_SUPPORT
+	const int rounds = 200;
+
+	llong t0 = ESystem::nanoTime();
+	for (int i=0; i<rounds; i++) {
+		EFiberScheduler scheduler;
+		scheduler.schedule([](){});
+		scheduler.join(4);
+	}
+	llong t1 = ESystem::nanoTime();
+
+	EFiberScheduler scheduler;
+	scheduler.start(4);
+	for (int i=0; i<rounds; i++) {
+		scheduler.schedule([](){});
+		scheduler.join();
+	}
+	llong t2 = ESystem::nanoTime();
+	scheduler.stop();
+
+	LOG("join(4) each round: %lld us, start(4) once and join() each round: %lld us",
+			(t1 - t0) / 1000 / rounds, (t2 - t1) / 1000 / rounds);
+#endif
+}
+
+//=============================================================================
+//4 threads, 60 sleeping fibers of a key on thread 0, then 60 more fibers placed
+//by the balance policy, the fibers of each thread:
+//linux:
+//  round robin : 75 15 15 15
+//  least loaded: 60 20 20 20
+//  two choices : 60 21 19 20
+
+static void balance_placement(EFiberScheduler::BalancePolicy policy, const char* name) {
+#ifdef CPP11_SUPPORT
+	EFiberScheduler scheduler;
+	scheduler.setBalancePolicy(policy);
+	scheduler.start(4);
+
+	llong key = 0;
+	while (scheduler.threadIndexOfKey(key) != 0) {
+		key++;
+	}
+	volatile boolean done = false;
+	for (int i=0; i<60; i++) {
+		scheduler.scheduleWithKey(key, [&]() {
+			while (!done) {
+				EFiber::sleep(10);
+			}
+		});
+	}
+	EThread::sleep(50);
+	for (int i=0; i<60; i++) {
+		scheduler.schedule([&]() {
+			while (!done) {
+				EFiber::sleep(10);
+			}
+		});
+		EThread::sleep(1);
+	}
+	EThread::sleep(50);
+
+	int fibers[4];
+	for (int i=0; i<4; i++) {
+		EFiberScheduler::ThreadLoad load;
+		scheduler.getThreadLoad(i, &load);
+		fibers[i] = load.fibers;
+	}
+	done = true;
+	scheduler.join();
+	scheduler.stop();
+
+	LOG("%s: %d %d %d %d", name, fibers[0], fibers[1], fibers[2], fibers[3]);
+#endif
+}
+
+static void test_balance_policy_performance() {
+	EFiberDebugger::getInstance().debugOn(EFiberDebugger::NONE);
+
+	balance_placement(EFiberScheduler::BALANCE_ROUND_ROBIN, "round robin ");
+	balance_placement(EFiberScheduler::BALANCE_LEAST_LOADED, "least loaded");
+	balance_placement(EFiberScheduler::BALANCE_TWO_CHOICES, "two choices ");
+}
+
+//=============================================================================
+//join(4) with work stealing, 64 keys of 4 fibers each adding 1000 times to a
+//per key counter without a lock, yielding in between:
+//linux: 31 ms, misplaced 0, lost 0, keys per thread 17 16 16 15
+
+static void test_keyed_performance() {
+	EFiberDebugger::getInstance().debugOn(EFiberDebugger::NONE);
+
+#ifdef CPP11_SUPPORT
+	const int keys = 64;
+	const int rounds = 1000;
+	EFiberScheduler scheduler;
+	scheduler.setWorkStealing(true);
+
+	llong counters[keys] = {0};
+	volatile int misplaced = 0;
+	for (int k=0; k<keys; k++) {
+		for (int i=0; i<4; i++) {
+			scheduler.scheduleWithKey(k, [&, k]() {
+				int index = scheduler.threadIndexOfKey(k);
+				for (int j=0; j<rounds; j++) {
+					counters[k]++; // the key's fibers all run on its thread.
+					EFiber::yield();
+					if (EFiber::currentFiber()->getThreadIndex() != index) {
+						__sync_add_and_fetch(&misplaced, 1);
+					}
+				}
+			});
+		}
+	}
+
+	llong t1 = ESystem::currentTimeMillis();
+	scheduler.join(4);
+	llong t2 = ESystem::currentTimeMillis();
+
+	int lost = 0;
+	int spread[4] = {0};
+	for (int k=0; k<keys; k++) {
+		lost += 4 * rounds - counters[k];
+		spread[scheduler.threadIndexOfKey(k)]++;
+	}
+	LOG("%d ms, misplaced %d, lost %d, keys per thread %d %d %d %d", (int)(t2 - t1),
+			misplaced, lost, spread[0], spread[1], spread[2], spread[3]);
+#endif
+}
+
+//=============================================================================
+//1 thread, 500 background fibers each running 10 x 20us of cpu, an urgent
+//fiber every 2ms, its latency from schedule() to its run:
+//linux:
+//  fifo    : urgent avg 1903 us, max 10964 us, background done in 111 ms
+//  strict  : urgent avg 2 us, max 13 us, background done in 111 ms
+//  weighted: urgent avg 2 us, max 12 us, background done in 109 ms
+
+static void urgent_latency(EFiberScheduler::PriorityPolicy policy, const char* name) {
+#ifdef CPP11_SUPPORT
+	EFiberScheduler scheduler;
+	scheduler.setPriorityPolicy(policy);
+
+	int left = 500;
+	llong t0 = ESystem::nanoTime(), t1 = 0;
+	for (int i=0; i<500; i++) {
+		sp<EFiber> fiber = new EFiberTarget([&]() {
+			for (int j=0; j<10; j++) {
+				llong t = ESystem::nanoTime();
+				while (ESystem::nanoTime() - t < 20000) {
+				}
+				EFiber::yield();
+			}
+			if (--left == 0) {
+				t1 = ESystem::nanoTime();
+			}
+		});
+		fiber->setPriority(EFiber::PRIORITY_BACKGROUND);
+		scheduler.schedule(fiber);
+	}
+
+	const int checks = 40;
+	llong latency = 0, maxLatency = 0;
+	scheduler.schedule([&]() {
+		for (int i=0; i<checks; i++) {
+			EFiber::sleep(2);
+			llong t = ESystem::nanoTime();
+			sp<EFiber> check = new EFiberTarget([&, t]() {
+				llong us = (ESystem::nanoTime() - t) / 1000;
+				latency += us;
+				maxLatency = ES_MAX(maxLatency, us);
+			});
+			check->setPriority(EFiber::PRIORITY_URGENT);
+			scheduler.schedule(check);
+		}
+	});
+	scheduler.join();
+	LOG("%s: urgent avg %lld us, max %lld us, background done in %lld ms", name,
+			latency / checks, maxLatency, (t1 - t0) / 1000000);
+#endif
+}
+
+static void test_priority_performance() {
+	EFiberDebugger::getInstance().debugOn(EFiberDebugger::NONE);
+
+	urgent_latency(EFiberScheduler::PRIORITY_FIFO, "fifo    ");
+	urgent_latency(EFiberScheduler::PRIORITY_STRICT, "strict  ");
+	urgent_latency(EFiberScheduler::PRIORITY_WEIGHTED, "weighted");
+}
+
+//=============================================================================
+//1 thread, a burst of 10 requests each 1ms from outside, 3 x 50us of cpu each
+//with a 10ms deadline, about 1.4 times the capacity:
+//linux:
+//  fifo            : sla hits 60 of 3000 (2.0%), ran 3000 (missed 0, canceled 0)
+//  edf             : sla hits 200 of 3000 (6.7%), ran 3000 (missed 2780, canceled 0)
+//  edf + cancel    : sla hits 260 of 3000 (8.7%), ran 2144 (missed 1, canceled 856)
+//  edf + cancel 2ms: sla hits 2115 of 3000 (70.5%), ran 2115 (missed 0, canceled 885)
+
+static void deadline_load(EFiberScheduler::PriorityPolicy policy, boolean cancel,
+		llong marginMillis, const char* name) {
+#ifdef CPP11_SUPPORT
+	EFiberScheduler scheduler;
+	scheduler.setPriorityPolicy(policy, 1);
+	scheduler.setCancelExpired(cancel, marginMillis);
+
+	const int bursts = 300;
+	const int perBurst = 10;
+	EAtomicCounter hits, done;
+
+	// arrivals at a fixed rate, whatever the backlog is.
+	scheduler.start(1);
+	for (int i=0; i<bursts; i++) {
+		EThread::sleep(1);
+		EDate deadline(ESystem::currentTimeMillis() + 10);
+		for (int j=0; j<perBurst; j++) {
+			scheduler.schedule([&]() {
+				for (int k=0; k<3; k++) {
+					llong t = ESystem::nanoTime();
+					while (ESystem::nanoTime() - t < 50000) {
+					}
+					EFiber::yield();
+				}
+				if (ESystem::currentTimeMillis() <= EFiber::currentFiber()->getDeadline()) {
+					hits++;
+				}
+				done++;
+			}, &deadline);
+		}
+	}
+	scheduler.join();
+	scheduler.stop();
+
+	EFiberScheduler::Stats stats = scheduler.getStats();
+	LOG("%s: sla hits %d of %d (%.1f%%), ran %d (missed %lld, canceled %lld)", name,
+			hits.value(), bursts * perBurst, hits.value() * 100.0 / (bursts * perBurst),
+			done.value(), stats.deadlinesMissed, stats.deadlinesCanceled);
+#endif
+}
+
+static void test_deadline_performance() {
+	EFiberDebugger::getInstance().debugOn(EFiberDebugger::NONE);
+
+	deadline_load(EFiberScheduler::PRIORITY_FIFO, false, 0, "fifo            ");
+	deadline_load(EFiberScheduler::PRIORITY_DEADLINE, false, 0, "edf             ");
+	deadline_load(EFiberScheduler::PRIORITY_DEADLINE, true, 0, "edf + cancel    ");
+	deadline_load(EFiberScheduler::PRIORITY_DEADLINE, true, 2, "edf + cancel 2ms");
+}
+
+//=============================================================================
+//1 thread, two fibers ping-pong over channels, or 4 fibers take turns on a mutex
+//held over a yield, with 100 (16) other fibers yielding in the run queue:
+//linux:
+//  ping-pong fifo     : 15957 ns per round trip
+//  ping-pong run next : 2336 ns per round trip (run next 177779)
+//  mutex fifo         : 2531 ns per lock
+//  mutex run next     : 1455 ns per lock (run next 79999)
+
+static void channel_ping_pong(boolean runNext, const char* name) {
+#ifdef CPP11_SUPPORT
+	EFiberScheduler scheduler;
+	scheduler.setRunNext(runNext);
+
+	const int rounds = 100000;
+	EFiberChannel<EString> ping(0), pong(0);
+	volatile boolean done = false;
+	llong t0 = 0, t1 = 0;
+
+	scheduler.schedule([&]() {
+		t0 = ESystem::nanoTime();
+		for (int i=0; i<rounds; i++) {
+			ping.write(new EString("ping"));
+			pong.read();
+		}
+		t1 = ESystem::nanoTime();
+		done = true;
+	});
+	scheduler.schedule([&]() {
+		for (int i=0; i<rounds; i++) {
+			sp<EString> s = ping.read();
+			pong.write(s);
+		}
+	});
+	for (int i=0; i<100; i++) {
+		scheduler.schedule([&]() {
+			while (!done) {
+				EFiber::yield();
+			}
+		});
+	}
+
+	scheduler.join();
+	LOG("%s: %lld ns per round trip (run next %lld)", name, (t1 - t0) / rounds,
+			scheduler.getStats().runNextRuns);
+#endif
+}
+
+static void mutex_handoff(boolean runNext, const char* name) {
+#ifdef CPP11_SUPPORT
+	EFiberScheduler scheduler;
+	scheduler.setRunNext(runNext);
+
+	const int loops = 20000;
+	const int lockers = 4;
+	EFiberMutex mutex;
+	llong value = 0;
+	volatile int finished = 0;
+
+	llong t0 = ESystem::nanoTime();
+	for (int f=0; f<lockers; f++) {
+		scheduler.schedule([&]() {
+			for (int i=0; i<loops; i++) {
+				mutex.lock();
+				value++;
+				EFiber::yield();
+				mutex.unlock();
+			}
+			__sync_add_and_fetch(&finished, 1);
+		});
+	}
+	for (int i=0; i<16; i++) {
+		scheduler.schedule([&]() {
+			while (finished < lockers) {
+				EFiber::yield();
+			}
+		});
+	}
+
+	scheduler.join();
+	llong t1 = ESystem::nanoTime();
+	LOG("%s: %lld ns per lock (run next %lld)", name, (t1 - t0) / (lockers * loops),
+			scheduler.getStats().runNextRuns);
+#endif
+}
+
+static void test_run_next_performance() {
+	EFiberDebugger::getInstance().debugOn(EFiberDebugger::NONE);
+
+	channel_ping_pong(false, "ping-pong fifo    ");
+	channel_ping_pong(true, "ping-pong run next");
+	mutex_handoff(false, "mutex fifo        ");
+	mutex_handoff(true, "mutex run next    ");
+}
+
+//=============================================================================
+//1 thread, cpu-bound fibers of two groups weighted 3:1 next to a light group
+//with a request each ms, its latency over the 1ms sleep (fifo charges no group,
+//the cpu goes by the count of fibers):
+//linux:
+//  fifo  8+8 : light avg 144 us, max 3097 us
+//  fair  8+8 : group1 224 ms, group2 74 ms, light avg 8 us, max 2344 us
+//  fifo 2+30 : light avg 930 us, max 5496 us
+//  fair 2+30 : group1 222 ms, group2 74 ms, light avg 4 us, max 2267 us
+
+static void group_share(EFiberScheduler::PriorityPolicy policy, int fibers1, int fibers2,
+		const char* name) {
+#ifdef CPP11_SUPPORT
+	EFiberScheduler scheduler;
+	scheduler.setPriorityPolicy(policy);
+	scheduler.setIoPollPolicy(EFiberScheduler::IO_POLL_ADAPTIVE);
+	scheduler.setGroupWeight(1, 3);
+	scheduler.setGroupWeight(2, 1);
+
+	volatile boolean done = false;
+	for (int group=1; group<=2; group++) {
+		int count = (group == 1) ? fibers1 : fibers2;
+		for (int i=0; i<count; i++) {
+			sp<EFiber> fiber = new EFiberTarget([&]() {
+				while (!done) {
+					volatile llong x = 0;
+					for (int j=0; j<20000; j++) x += j;
+					EFiber::yield();
+				}
+			});
+			fiber->setGroup(group);
+			scheduler.schedule(fiber);
+		}
+	}
+
+	llong latency = 0, maxLatency = 0;
+	const int requests = 300;
+	sp<EFiber> light = new EFiberTarget([&]() {
+		for (int i=0; i<requests; i++) {
+			llong t = ESystem::nanoTime();
+			EFiber::sleep(1);
+			llong us = (ESystem::nanoTime() - t) / 1000 - 1000;
+			latency += us;
+			maxLatency = ES_MAX(maxLatency, us);
+		}
+		done = true;
+	});
+	light->setGroup(3);
+	scheduler.schedule(light);
+
+	scheduler.join();
+	EFiberScheduler::Stats stats = scheduler.getStats();
+	LOG("%s: group1 %lld ms, group2 %lld ms, light avg %lld us, max %lld us", name,
+			stats.groupRunNanos[1] / 1000000, stats.groupRunNanos[2] / 1000000,
+			latency / requests, maxLatency);
+#endif
+}
+
+static void test_fiber_group_performance() {
+	EFiberDebugger::getInstance().debugOn(EFiberDebugger::NONE);
+
+	group_share(EFiberScheduler::PRIORITY_FIFO, 8, 8, "fifo  8+8 ");
+	group_share(EFiberScheduler::PRIORITY_FAIR_SHARE, 8, 8, "fair  8+8 ");
+	group_share(EFiberScheduler::PRIORITY_FIFO, 2, 30, "fifo 2+30 ");
+	group_share(EFiberScheduler::PRIORITY_FAIR_SHARE, 2, 30, "fair 2+30 ");
+}
+
+//=============================================================================
+//1 thread, two fibers wake each other by blockers next to a sleeping fiber, the
+//blocking one goes back to the loop or switches to the woken one by yieldTo():
+//linux:
+//  through the loop: 445 ns per round trip (direct 0)
+//  yieldTo         : 323 ns per round trip (direct 888888)
+
+static void blocker_handoff(boolean direct, const char* name) {
+#ifdef CPP11_SUPPORT
+	EFiberScheduler scheduler;
+	scheduler.setRunNext(direct); // yieldTo() takes the run next fiber.
+	scheduler.setIoPollPolicy(EFiberScheduler::IO_POLL_ADAPTIVE);
+
+	const int rounds = 1000000;
+	EFiberBlocker b1(0), b2(0);
+	volatile boolean done = false;
+	llong t0 = 0, t1 = 0;
+
+	scheduler.schedule([&]() {
+		t0 = ESystem::nanoTime();
+		for (int i=0; i<rounds; i++) {
+			b2.wakeUp();
+			b1.wait();
+		}
+		t1 = ESystem::nanoTime();
+		done = true;
+		b2.wakeUp();
+	});
+	scheduler.schedule([&]() {
+		while (!done) {
+			b1.wakeUp();
+			b2.wait();
+		}
+	});
+	scheduler.schedule([&]() {
+		// an io waiter as a server has, the loop checks for io polls.
+		while (!done) {
+			EFiber::sleep(10);
+		}
+	});
+
+	scheduler.join();
+	LOG("%s: %lld ns per round trip (direct %lld)", name, (t1 - t0) / rounds,
+			scheduler.getStats().directSwitches);
+#endif
+}
+
+static void test_yield_to_performance() {
+	EFiberDebugger::getInstance().debugOn(EFiberDebugger::NONE);
+
+	blocker_handoff(false, "through the loop");
+	blocker_handoff(true, "yieldTo         ");
+}
+
 //=============================================================================
 //wrk -t12 -c100 -d30s -T30s -H "Connection: close" http://127.0.0.1:9988/
 //linux: Requests/sec: 246052
@@ -257,6 +1092,20 @@ MAIN_IMPL(testeco_benchmark) {
 
 		do {
 //			test_scheduling_performance();
+//			test_spawn_performance();
+//			test_stack_memory_performance();
+//			test_work_stealing_performance();
+//			test_io_poll_performance();
+//			test_idle_policy_performance();
+//			test_wakeup_coalescing_performance();
+//			test_worker_pool_performance();
+//			test_balance_policy_performance();
+//			test_keyed_performance();
+//			test_priority_performance();
+//			test_deadline_performance();
+//			test_run_next_performance();
+//			test_yield_to_performance();
+//			test_fiber_group_performance();
 			test_iohooking_performance();
 		} while (1);
 	}
@@ -37,7 +37,20 @@ static void SigHandler(int sig) {
 	gStopFlag = 1;
 }
 
-static int balance_callback(EFiber* fiber, int threadNums) {
+static int least_loaded_worker(int threadNums, EFiberScheduler* scheduler) {
+	int best = 1;
+	llong bestScore = -1;
+	EFiberScheduler::ThreadLoad load;
+	for (int i = 1; i < threadNums; i++) {
+		if (scheduler->getThreadLoad(i, &load) && (bestScore < 0 || load.score() < bestScore)) {
+			best = i;
+			bestScore = load.score();
+		}
+	}
+	return best;
+}
+
+static int balance_callback(EFiber* fiber, int threadNums, EFiberScheduler* scheduler) {
 	int fid = fiber->getId();
 	if (fid == 0) { // 0 is the first fiber.
 		return 0;   // 0 is the join()'s thread
@@ -46,7 +59,7 @@ static int balance_callback(EFiber* fiber, int threadNums) {
 		if (id > 0) {
 			return (int)id;
 		} else {
-			return fid % (threadNums - 1) + 1; // balance to other's threads.
+			return least_loaded_worker(threadNums, scheduler); // balance to other's threads.
 		}
 	}
 }
@@ -208,7 +221,7 @@ MAIN_IMPL(testeco_echoserver) {
 
 		// balance callback
 #ifdef CPP11_SUPPORT
-		scheduler.setBalanceCallback([](EFiber* fiber, int threadNums){
+		scheduler.setLoadBalanceCallback([](EFiber* fiber, int threadNums, EFiberScheduler* scheduler){
 			int fid = fiber->getId();
 			if (fid == 0) { // 0 is the first fiber.
 				return 0;   // 0 is the join()'s thread
@@ -217,12 +230,12 @@ MAIN_IMPL(testeco_echoserver) {
 				if (id > 0) {
 					return (int)id;
 				} else {
-					return fid % (threadNums - 1) + 1; // balance to other's threads.
+					return least_loaded_worker(threadNums, scheduler); // balance to other's threads.
 				}
 			}
 		});
 #else
-		scheduler.setBalanceCallback(balance_callback);
+		scheduler.setLoadBalanceCallback(balance_callback);
 #endif
 
 		scheduler.join(FIBER_THREADS);
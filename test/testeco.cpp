@@ -16,6 +16,7 @@
 #include <sys/epoll.h>
 #include <linux/version.h>
 #include <sys/sendfile.h>
+#include <sched.h>
 #endif
 #ifdef __APPLE__
 #include <sys/event.h>
@@ -569,6 +570,60 @@ static void test_sleep() {
 	LOG("end of test_sleep().");
 }
 
+static void test_shared_stack() {
+	EFiberScheduler scheduler;
+	scheduler.setSharedStack(2);
+
+	EAtomicCounter done(0);
+	for (int i=0; i<1000; i++) {
+		sp<EFiber> fiber = new EFiberTarget([&, i]() {
+			char buf[1024];
+			memset(buf, i % 128, sizeof(buf));
+			EFiber::sleep(i % 10);
+			for (int j=0; j<sizeof(buf); j++) {
+				ES_ASSERT(buf[j] == i % 128);
+			}
+			done++;
+		});
+		fiber->setSharedStack(true);
+		scheduler.schedule(fiber);
+	}
+
+	// shares its stack variable, so it keeps a private stack (default).
+	scheduler.schedule([&]() {
+		EFiberChannel<EInteger> channel(0);
+		scheduler.schedule([&]() {
+			channel.write(new EInteger(1));
+		});
+		channel.read();
+		done++;
+	});
+
+	scheduler.join(4);
+
+	LOG("end of test_shared_stack(), done=%d", done.value());
+}
+
+static void test_cancel_before_run() {
+	EFiberScheduler scheduler;
+	scheduler.setDropCanceled(true);
+
+	EAtomicCounter runs(0);
+	for (int i=0; i<10000; i++) {
+		sp<EFiber> fiber = scheduler.schedule([&]() {
+			runs++;
+		});
+		if (i % 2 == 0) {
+			// canceled before the first run, no stack would be allocated.
+			fiber->cancel();
+		}
+	}
+
+	scheduler.join(4);
+
+	LOG("end of test_cancel_before_run(), runs=%d", runs.value());
+}
+
 static void fiber_destroyed_callback(void* data) {
 	if (data) {
 		EString* s = (EString*)data;
@@ -918,6 +973,206 @@ static void test_hook_pipe() {
 	eso_pipe_destroy(&pipe);
 }
 
+static void test_stack_hibernation() {
+	es_pipe_t* pipe = eso_pipe_create();
+
+	EFiberScheduler scheduler;
+	scheduler.setStackHibernation(1000);
+
+	scheduler.schedule([&]() {
+		char mark[32];
+		memset(mark, 'x', sizeof(mark));
+
+		// hibernated while reading.
+		char buf[32] = {0};
+		int r = eso_fread(buf, sizeof(buf), pipe->in);
+		LOG("r=%d, s=%s", r, buf);
+
+		for (int i=0; i<sizeof(mark); i++) {
+			ES_ASSERT(mark[i] == 'x');
+		}
+	});
+	scheduler.schedule([&]() {
+		sleep(3);
+		eso_fwrite("123456", 6, pipe->out);
+		LOG("w");
+	});
+	scheduler.join();
+
+	EFiberScheduler::Stats stats = scheduler.getStats();
+	LOG("hibernated fibers=%lld, bytes=%lld", stats.hibernatedFibers, stats.hibernatedBytes);
+
+	eso_pipe_destroy(&pipe);
+}
+
+static int deep_stack_func(int depth) {
+	char buf[1024];
+	memset(buf, depth, sizeof(buf));
+	return (depth > 0) ? deep_stack_func(depth - 1) + buf[depth] : 0;
+}
+
+static void test_stack_trimming() {
+	EFiberScheduler scheduler;
+	scheduler.setStackTrimming(500);
+
+	for (int i=0; i<100; i++) {
+		scheduler.schedule([]() {
+			// deep stack once, e.g. a tls handshake.
+			int r = deep_stack_func(64);
+			EFiber::sleep(2000);
+			LOG("r=%d", r);
+		}, 1024*1024);
+	}
+	scheduler.join(2);
+
+	EFiberScheduler::Stats stats = scheduler.getStats();
+	LOG("trimmed fibers=%lld, pages=%lld", stats.trimmedFibers, stats.trimmedPages);
+}
+
+static void test_stack_auto_sizing() {
+	EString profile;
+	{
+		EFiberScheduler scheduler;
+		scheduler.setStackAutoSizing(4);
+
+		for (int i=0; i<100; i++) {
+			sp<EFiber> fiber = new EFiberTarget([]() {
+				int r = deep_stack_func(32);
+				LOG("stack size=%d, r=%d", EFiber::currentFiber()->getStackSize(), r);
+			});
+			fiber->setName("handler");
+			scheduler.schedule(fiber);
+		}
+		scheduler.join(2);
+
+		profile = scheduler.exportStackProfile();
+		LOG("learned profile:\n%s", profile.c_str());
+	}
+
+	// the next startup.
+	EFiberScheduler scheduler;
+	scheduler.importStackProfile(profile.c_str());
+	sp<EFiber> fiber = new EFiberTarget([]() {
+		LOG("imported stack size=%d", EFiber::currentFiber()->getStackSize());
+	});
+	fiber->setName("handler");
+	scheduler.schedule(fiber);
+	scheduler.join();
+}
+
+static void test_thread_affinity() {
+	LOG("available processors: %d", EFiberScheduler::availableProcessors());
+
+	EFiberScheduler scheduler;
+	scheduler.setThreadAffinity(EFiberScheduler::AFFINITY_NUMA_NODE);
+
+	for (int i=0; i<8; i++) {
+		scheduler.schedule([]() {
+#ifdef __linux__
+			LOG("thread index = %d, cpu = %d", EFiber::currentFiber()->getThreadIndex(), sched_getcpu());
+#else
+			LOG("thread index = %d", EFiber::currentFiber()->getThreadIndex());
+#endif
+		});
+	}
+	scheduler.join(0);
+}
+
+static void test_worker_pool() {
+	EFiberScheduler scheduler;
+	scheduler.start(4);
+
+	for (int round=0; round<3; round++) {
+		// from a thread which is not a scheduler thread.
+		sp<EThread> thread = EThread::executeX([&]() {
+			for (int i=0; i<100; i++) {
+				scheduler.schedule([]() {
+					EFiber::sleep(10);
+				});
+			}
+		});
+		thread->join();
+
+		scheduler.join(); // threads go on.
+		LOG("round %d done, fibers=%d", round, scheduler.totalFiberCount());
+	}
+
+	scheduler.stop();
+	LOG("stopped, wakeups=%lld", scheduler.getStats().wakeupsIssued);
+
+	// schedule() racing start(), a fiber that saw no threads yet is dispatched.
+	const int rounds = 20, fibers = 1000;
+	EAtomicCounter runs(0);
+	for (int round=0; round<rounds; round++) {
+		sp<EThread> thread = EThread::executeX([&]() {
+			for (int i=0; i<fibers; i++) {
+				scheduler.schedule([&]() {
+					runs++;
+				});
+				if (i % 100 == 0) {
+					EThread::yield();
+				}
+			}
+		});
+		scheduler.start(4);
+		thread->join();
+		scheduler.join();
+		scheduler.stop();
+	}
+	LOG("raced start(), runs=%d of %d", runs.value(), rounds * fibers);
+
+	// schedule() racing stop(), a fiber of a stopping pool runs on the next
+	// start() or join().
+	for (int round=0; round<rounds; round++) {
+		sp<EThread> thread = EThread::executeX([&]() {
+			for (int i=0; i<fibers; i++) {
+				scheduler.schedule([&]() {
+					runs++;
+				});
+				if (i % 100 == 0) {
+					EThread::yield();
+				}
+			}
+		});
+		scheduler.start(4);
+		scheduler.stop();
+		thread->join();
+	}
+	scheduler.join();
+	LOG("raced stop(), runs=%d of %d", runs.value(), 2 * rounds * fibers);
+}
+
+static void test_elastic_threads() {
+	EFiberScheduler scheduler;
+	scheduler.setElasticPolicy(8, 1000, 500);
+	scheduler.start(1, 4);
+
+	// a burst of cpu bound fibers.
+	for (int i=0; i<2000; i++) {
+		scheduler.schedule([]() {
+			for (int k=0; k<20; k++) {
+				volatile llong x = 0;
+				for (int j=0; j<20000; j++) x += j;
+				EFiber::yield();
+			}
+		});
+	}
+	int peak = 0;
+	while (scheduler.totalFiberCount() > 0) {
+		peak = ES_MAX(peak, scheduler.getThreadCount());
+		EThread::sleep(5);
+	}
+	scheduler.join();
+	LOG("burst done, peak threads=%d", peak);
+
+	EThread::sleep(2000);
+	LOG("idle, threads=%d", scheduler.getThreadCount());
+
+	scheduler.stop();
+	EFiberScheduler::Stats stats = scheduler.getStats();
+	LOG("grown=%lld, retired=%lld", stats.threadsGrown, stats.threadsRetired);
+}
+
 static void test_timer() {
 	class Timer1: public EFiberTimer {
 	public:
@@ -1282,6 +1537,178 @@ static void test_efc_in_fiber() {
 	scheduler.join();
 }
 
+static void test_load_balance() {
+	EFiberScheduler scheduler;
+	scheduler.setBalancePolicy(EFiberScheduler::BALANCE_LEAST_LOADED);
+	scheduler.start(4);
+
+	// long living fibers pile up on the threads where they're placed.
+	volatile int counts[4] = {0};
+	for (int i=0; i<64; i++) {
+		scheduler.schedule([&]() {
+			__sync_fetch_and_add(&counts[EFiber::currentFiber()->getThreadIndex()], 1);
+			EFiber::sleep(200);
+		});
+		EThread::sleep(1);
+	}
+	EThread::sleep(50);
+	for (int i=0; i<4; i++) {
+		EFiberScheduler::ThreadLoad load;
+		if (scheduler.getThreadLoad(i, &load)) {
+			LOG("thread %d: placed=%d, fibers=%d, queued=%d, waiters=%d, busy=%d",
+					i, counts[i], load.fibers, load.queued, load.waiters, load.busyPermille);
+		}
+	}
+	scheduler.join();
+
+	// a user balancer with the same loads, odd threads only.
+	scheduler.setLoadBalanceCallback([](EFiber* fiber, int threadNums, EFiberScheduler* scheduler) {
+		EFiberScheduler::ThreadLoad load1, load3;
+		scheduler->getThreadLoad(1, &load1);
+		scheduler->getThreadLoad(3, &load3);
+		return (load3.score() < load1.score()) ? 3 : 1;
+	});
+	for (int i=0; i<16; i++) {
+		scheduler.schedule([]() {
+			LOG("thread index = %d", EFiber::currentFiber()->getThreadIndex());
+			EFiber::sleep(100);
+		});
+	}
+	scheduler.stop();
+}
+
+static void test_schedule_with_key() {
+	EFiberScheduler scheduler;
+
+	// per thread session state, no lock as a session never leaves its thread.
+	static int requests[4][10];
+	memset(requests, 0, sizeof(requests));
+
+	for (int i=0; i<100; i++) {
+		int sessionId = i % 10;
+		scheduler.scheduleWithKey(sessionId, [sessionId, &scheduler]() {
+			requests[EFiber::currentFiber()->getThreadIndex()][sessionId]++;
+
+			// a child stays with the session.
+			scheduler.schedule([sessionId]() {
+				LOG("session %d child on thread %d", sessionId, EFiber::currentFiber()->getThreadIndex());
+			});
+		});
+	}
+	scheduler.join(4);
+
+	for (int i=0; i<4; i++) {
+		for (int k=0; k<10; k++) {
+			if (requests[i][k] > 0) {
+				LOG("thread %d: session %d requests=%d, thread of key=%d",
+						i, k, requests[i][k], scheduler.threadIndexOfKey(k));
+			}
+		}
+	}
+}
+
+static void test_priority() {
+	EFiberScheduler scheduler;
+	scheduler.setPriorityPolicy(EFiberScheduler::PRIORITY_STRICT, 20);
+
+	scheduler.schedule([&]() {
+		// a flood of bulk work, its children are background ones too.
+		EFiber::currentFiber()->setPriority(EFiber::PRIORITY_BACKGROUND);
+		for (int i=0; i<1000; i++) {
+			scheduler.schedule([]() {
+				for (int k=0; k<10; k++) {
+					volatile llong x = 0;
+					for (int j=0; j<10000; j++) x += j;
+					EFiber::yield();
+				}
+			});
+		}
+	});
+
+	scheduler.schedule([&]() {
+		for (int i=0; i<10; i++) {
+			EFiber::sleep(10);
+			llong t = ESystem::nanoTime();
+			sp<EFiber> check = new EFiberTarget([t]() {
+				LOG("health check waited %lld us", (ESystem::nanoTime() - t) / 1000);
+			});
+			check->setPriority(EFiber::PRIORITY_URGENT);
+			scheduler.schedule(check);
+		}
+	});
+
+	scheduler.join(2);
+
+	EFiberScheduler::Stats stats = scheduler.getStats();
+	const char* names[] = {"urgent", "normal", "background"};
+	for (int i=0; i<EFiber::PRIORITY_CLASSES; i++) {
+		LOG("%s: runs=%lld, avg wait=%lld us, max wait=%lld us", names[i], stats.priorityRuns[i],
+				stats.priorityWaitMicros[i] / ES_MAX(stats.priorityRuns[i], 1), stats.priorityMaxWaitMicros[i]);
+	}
+	LOG("starved runs=%lld", stats.starvedRuns);
+}
+
+static void test_fiber_group() {
+	EFiberScheduler scheduler;
+	scheduler.setPriorityPolicy(EFiberScheduler::PRIORITY_FAIR_SHARE);
+	scheduler.setGroupWeight(1, 3); // tenant 1 gets 3/4 of the cpu when both are busy.
+	scheduler.setGroupWeight(2, 1);
+
+	volatile boolean done = false;
+	for (int group=1; group<=2; group++) {
+		scheduler.schedule([&, group]() {
+			// its children are in the group too.
+			EFiber::currentFiber()->setGroup(group);
+			for (int i=0; i<8; i++) {
+				scheduler.schedule([&]() {
+					while (!done) {
+						volatile llong x = 0;
+						for (int j=0; j<10000; j++) x += j;
+						EFiber::yield();
+					}
+				});
+			}
+		});
+	}
+
+	scheduler.schedule([&]() {
+		EFiber::sleep(300);
+		done = true;
+	});
+
+	scheduler.join();
+
+	EFiberScheduler::Stats stats = scheduler.getStats();
+	for (int group=1; group<=2; group++) {
+		LOG("group %d: runs=%lld, run time=%lld ms", group, stats.groupRuns[group],
+				stats.groupRunNanos[group] / 1000000);
+	}
+}
+
+static void test_yield_to() {
+	EFiberScheduler scheduler;
+	EFiberChannel<EString> channel(1);
+
+	sp<EFiber> reader = scheduler.schedule([&]() {
+		sp<EString> s = channel.read();
+		LOG("reader got %s", s->c_str());
+	});
+
+	scheduler.schedule([&]() {
+		EFiber::yield(); // the reader blocks.
+		scheduler.schedule([]() {
+			LOG("a queued fiber runs");
+		});
+		channel.tryWrite(new EString("hello"));
+		// the reader was just woken, it runs before the queued one.
+		boolean direct = EFiber::yieldTo(reader.get());
+		LOG("writer resumed, direct switch: %d", direct);
+	});
+
+	scheduler.join();
+	LOG("direct switches=%lld", scheduler.getStats().directSwitches);
+}
+
 static void test_balance() {
 	EFiberScheduler scheduler;
 
@@ -1406,6 +1833,8 @@ MAIN_IMPL(testeco) {
 //			test_mutex_multi_thread();
 //			test_condition();
 //			test_sleep();
+//			test_shared_stack();
+//			test_cancel_before_run();
 //			test_timer();
 //			test_local();
 //			test_hook_connect1();
@@ -1418,6 +1847,17 @@ MAIN_IMPL(testeco) {
 //			test_hook_nonblocking();
 //			test_hook_read_write();
 //			test_hook_pipe();
+//			test_stack_hibernation();
+//			test_stack_trimming();
+//			test_stack_auto_sizing();
+//			test_thread_affinity();
+//			test_worker_pool();
+//			test_elastic_threads();
+//			test_load_balance();
+//			test_schedule_with_key();
+//			test_priority();
+//			test_yield_to();
+//			test_fiber_group();
 //			test_hook_kqueue();
 //			test_hook_gethostbyname();
 //			test_hook_sendfile();